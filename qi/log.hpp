@@ -15,50 +15,73 @@
 
 # include <map>
 # include <string>
+# include <vector>
 # include <iostream>
 # include <sstream>
+# include <streambuf>
 # include <cstdarg>
 # include <cstdio>
+# include <cstring>
 
 #include <boost/function/function_fwd.hpp>
+#include <boost/cstdint.hpp>
 
 #include <qi/config.hpp>
 #include <qi/os.hpp>
 
+// First macro argument, the category. The extra expansion works around
+// the MSVC preprocessor passing __VA_ARGS__ as a single argument.
+#define _QI_LOG_EXPAND(x) x
+#define _QI_LOG_FIRST_(first, ...) first
+#define _QI_LOG_FIRST(...) _QI_LOG_EXPAND(_QI_LOG_FIRST_(__VA_ARGS__, 0))
+
+// The level is checked before the LogStream is built: the stream operands
+// of a disabled statement are not even evaluated. The CallSite is a
+// static local of the statement, a single one even in an inline function
+// used by several translation units; the loops run once and only scope it.
+#define _QI_LOG_MESSAGE(level, ...)                                     \
+  for (bool _qiLogOnce = true; _qiLogOnce; _qiLogOnce = false)          \
+    for (static qi::log::detail::CallSite _qiLogSite; _qiLogOnce; _qiLogOnce = false) \
+      if (!qi::log::detail::isVisible(level, _qiLogSite, _QI_LOG_FIRST(__VA_ARGS__), \
+                                      __FILE__, __FUNCTION__, __LINE__)) \
+        ;                                                               \
+      else                                                              \
+        qi::log::LogStream(level, &_qiLogSite, __FILE__, __FUNCTION__, __LINE__, __VA_ARGS__).self()
+
 #if defined(NO_QI_DEBUG) || defined(NDEBUG)
 # define qiLogDebug(...)        if (false) qi::log::detail::NullStream(__VA_ARGS__).self()
 #else
-# define qiLogDebug(...)        qi::log::LogStream(qi::log::debug, __FILE__, __FUNCTION__, __LINE__, __VA_ARGS__).self()
+# define qiLogDebug(...)        _QI_LOG_MESSAGE(qi::log::debug, __VA_ARGS__)
 #endif
 
 #ifdef NO_QI_VERBOSE
 # define qiLogVerbose(...)      if (false) qi::log::detail::NullStream(__VA_ARGS__).self()
 #else
-# define qiLogVerbose(...)      qi::log::LogStream(qi::log::verbose, __FILE__, __FUNCTION__, __LINE__, __VA_ARGS__).self()
+# define qiLogVerbose(...)      _QI_LOG_MESSAGE(qi::log::verbose, __VA_ARGS__)
 #endif
 
 #ifdef NO_QI_INFO
 # define qiLogInfo(...)         if (false) qi::log::detail::NullStream(__VA_ARGS__).self()
 #else
-# define qiLogInfo(...)         qi::log::LogStream(qi::log::info, __FILE__, __FUNCTION__, __LINE__, __VA_ARGS__).self()
+# define qiLogInfo(...)         _QI_LOG_MESSAGE(qi::log::info, __VA_ARGS__)
 #endif
 
 #ifdef NO_QI_WARNING
 # define qiLogWarning(...)      if (false) qi::log::detail::NullStream(__VA_ARGS__).self()
 #else
-# define qiLogWarning(...)      qi::log::LogStream(qi::log::warning, __FILE__, __FUNCTION__, __LINE__, __VA_ARGS__).self()
+# define qiLogWarning(...)      _QI_LOG_MESSAGE(qi::log::warning, __VA_ARGS__)
 #endif
 
 #ifdef NO_QI_ERROR
 # define qiLogError(...)        if (false) qi::log::detail::NullStream(__VA_ARGS__).self()
 #else
-# define qiLogError(...)        qi::log::LogStream(qi::log::error, __FILE__, __FUNCTION__, __LINE__, __VA_ARGS__).self()
+# define qiLogError(...)        _QI_LOG_MESSAGE(qi::log::error, __VA_ARGS__)
 #endif
 
 #ifdef NO_QI_FATAL
 # define qiLogFatal(...)        if (false) qi::log::detail::NullStream(__VA_ARGS__).self()
 #else
-# define qiLogFatal(...)        qi::log::LogStream(qi::log::fatal, __FILE__, __FUNCTION__, __LINE__, __VA_ARGS__).self()
+# define qiLogFatal(...)        _QI_LOG_MESSAGE(qi::log::fatal, __VA_ARGS__)
 #endif
 
 
@@ -100,6 +123,47 @@ namespace qi {
           return self();
         }
 
+        template <typename T>
+        NullStream& kv(const char *, const T&)
+        {
+          return self();
+        }
+
+      };
+
+      /*
+       * Fixed size stream buffer used by LogStream: no allocation,
+       * the message is truncated once the buffer is full.
+       */
+      class LogStreamBuf: public std::streambuf
+      {
+      public:
+        LogStreamBuf()
+        {
+          setp(_buffer, _buffer + sizeof(_buffer) - 1);
+        }
+
+        void vprintf(const char *fmt, va_list vl)
+        {
+          std::ptrdiff_t avail = epptr() - pptr();
+         #ifdef _MSC_VER
+          int len = vsnprintf_s(pptr(), avail + 1, _TRUNCATE, fmt, vl);
+         #else
+          int len = vsnprintf(pptr(), avail + 1, fmt, vl);
+         #endif
+          if (len < 0 || len > avail)
+            len = (int)avail;
+          pbump(len);
+        }
+
+        const char *c_str()
+        {
+          *pptr() = '\0';
+          return _buffer;
+        }
+
+      private:
+        char _buffer[2048];
       };
 
     };
@@ -114,6 +178,216 @@ namespace qi {
         debug
     };
 
+    enum LogOverflowPolicy {
+        dropNewest = 0,
+        dropOldest,
+        blockWithTimeout,
+        spillToPool
+    };
+
+    /// Type of a LogField.
+    enum LogFieldType {
+        intField = 0,
+        uintField,
+        doubleField,
+        boolField,
+        stringField
+    };
+
+    /// Typed value logged with LogStream::kv().
+    struct LogField
+    {
+      const char   *key;
+      LogFieldType  type;
+      union
+      {
+        boost::int64_t   i;
+        boost::uint64_t  u;
+        double           d;
+        bool             b;
+        const char      *s;
+      } value;
+    };
+
+    /// Source of the record timestamps, see setTimestampClock().
+    enum LogClock {
+        monotonicClock = 0,
+        coarseClock,
+        tscClock
+    };
+
+    namespace detail {
+      // Rate limit and repeat state, see setRateLimit.
+      struct Throttle;
+      // Counters of a category, see qi::log::stats.
+      struct CategoryStats;
+
+      // Interned category, never freed. Its level is recomputed from the
+      // global verbosity and the category rules whenever they change.
+      struct Category
+      {
+        const char   *name;
+        LogLevel      level;
+        // in registration order, from 0
+        unsigned int  id;
+        // name cut or padded with spaces to 16 characters
+        const char   *padded;
+        // for the logs without call site
+        Throttle     *throttle;
+        CategoryStats *stats;
+      };
+
+      // Per log statement descriptor, see _QI_LOG_MESSAGE. Zero initialized,
+      // filled on first use by resolveCategory. Records point to it instead
+      // of copying the file and function names.
+      struct CallSite
+      {
+        // set last, see siteCategory
+        Category   *category;
+        // name of the first category when a constant array, compared by
+        // address, else null
+        const char *name;
+        const char *file;
+        const char *function;
+        int         line;
+        // next registered call site, see qi::log::callSites
+        CallSite   *next;
+        Throttle   *throttle;
+      };
+
+      // Most verbose level enabled for any category, read inline by the
+      // qiLog* macros so that a disabled statement costs a single test.
+      extern QI_API LogLevel maxVerbosity;
+
+      QI_API Category *category(const char *name);
+      QI_API Category *resolveCategory(CallSite   *site,
+                                       const char *name,
+                                       bool        constantName,
+                                       const char *file,
+                                       const char *function,
+                                       int         line);
+
+      // Binary copy of the arguments of a printf like log, formatted by
+      // the log thread, see qi::log::setDeferredFormatting. data starts
+      // with a copy of the format, fmtSize bytes with its '\0', then the
+      // arguments: the caller's format may be gone when it is formatted.
+      struct LogArgs
+      {
+        enum { capacity = 512 };
+
+        // the caller's format, null when nothing was captured; only
+        // valid during the log call
+        const char   *fmt;
+        unsigned int  fmtSize;
+        unsigned int  size;
+        char          data[capacity];
+      };
+
+      // Binary copy of the fields of a log, see LogStream::kv.
+      struct LogFields
+      {
+        enum { capacity = 512, maxCount = 16 };
+
+        unsigned int  size;
+        unsigned int  count;
+        char          data[capacity];
+      };
+
+      // Copy the key and the value, the field is dropped if it does not fit.
+      QI_API void addField(LogFields *fields, const char *key, const LogField &field);
+
+      // Set by setDeferredFormatting, only for asynchronous logs.
+      extern QI_API bool deferredFormatting;
+
+      // Copy the arguments of fmt, false if one of them cannot be deferred
+      // or if they do not fit.
+      QI_API bool captureArgs(LogArgs *args, const char *fmt, va_list vl);
+
+      // Entry point of LogStream objects built by the qiLog* macros:
+      // the level was already checked against the category. args, when
+      // given, is formatted before msg. site may be null, the level is
+      // then checked here.
+      QI_API void log(const CallSite         *site,
+                      const qi::log::LogLevel verb,
+                      const char              *category,
+                      const char              *msg,
+                      const char              *file,
+                      const char              *fct,
+                      const int               line,
+                      const LogArgs           *args,
+                      const LogFields         *fields);
+
+      inline bool isVisible(const LogLevel level)
+      {
+        return level <= maxVerbosity;
+      }
+
+      // The category of a site, null until resolveCategory published
+      // the other fields of the site.
+      inline Category *siteCategory(const CallSite &site)
+      {
+#if defined(__ATOMIC_ACQUIRE)
+        return __atomic_load_n(&site.category, __ATOMIC_ACQUIRE);
+#else
+        // volatile reads have acquire semantics with MSVC
+        Category *c = *static_cast<Category *const volatile *>(&site.category);
+# if defined(__GNUC__)
+        __sync_synchronize();
+# endif
+        return c;
+#endif
+      }
+
+      // A site may log to several categories, only the first one is
+      // cached. A constant array, normally a string literal, cannot
+      // change: it is compared by address.
+      template <unsigned int N>
+      inline bool isVisible(const LogLevel level,
+                            CallSite      &site,
+                            const char    (&name)[N],
+                            const char    *file,
+                            const char    *function,
+                            int            line)
+      {
+        if (level > maxVerbosity)
+          return false;
+        Category *c = siteCategory(site);
+        if (!c || site.name != name)
+          c = resolveCategory(&site, name, true, file, function, line);
+        return level <= c->level;
+      }
+
+      // Any other name may come from a reused buffer, its text is compared
+      // rather than its address.
+      template <typename T>
+      inline bool isVisible(const LogLevel level,
+                            CallSite      &site,
+                            T *const      &name,
+                            const char    *file,
+                            const char    *function,
+                            int            line)
+      {
+        if (level > maxVerbosity)
+          return false;
+        Category *c = siteCategory(site);
+        if (!c || !name || (name != site.name && std::strcmp(c->name, name) != 0))
+          c = resolveCategory(&site, name, false, file, function, line);
+        return level <= c->level;
+      }
+
+      template <unsigned int N>
+      inline bool isVisible(const LogLevel level,
+                            CallSite      &site,
+                            char          (&name)[N],
+                            const char    *file,
+                            const char    *function,
+                            int            line)
+      {
+        const char *buffer = name;
+        return isVisible(level, site, buffer, file, function, line);
+      }
+    }
+
     typedef boost::function7<void,
                              const qi::log::LogLevel,
                              const qi::os::timeval,
@@ -123,12 +397,44 @@ namespace qi {
                              const char*,
                              int> logFuncHandler;
 
+    /// One record of a batch, valid until the handler returns.
+    struct LogRecord
+    {
+      qi::log::LogLevel level;
+      // monotonic, in nanoseconds, from the clock set by setTimestampClock
+      boost::uint64_t   timestamp;
+      // wall clock date of the timestamp
+      qi::os::timeval   date;
+      const char       *category;
+      // category cut or padded with spaces to 16 characters
+      const char       *paddedCategory;
+      const char       *message;
+      const char       *file;
+      const char       *function;
+      int               line;
+      // typed fields, not rendered in message, see formatFields()
+      const LogField   *fields;
+      unsigned int      fieldCount;
+    };
+
+    typedef boost::function2<void,
+                             const qi::log::LogRecord*,
+                             unsigned int> logBatchFuncHandler;
+
+    typedef boost::function0<void> logFlushFuncHandler;
+
     QI_API void init(qi::log::LogLevel verb = qi::log::info,
                      int ctx = 0,
-                     bool synchronous = true);
+                     bool synchronous = true,
+                     qi::log::LogOverflowPolicy policy = qi::log::dropNewest,
+                     unsigned int blockTimeout = 100);
 
     QI_API void destroy();
 
+    QI_API unsigned int formatFields(const qi::log::LogRecord &record,
+                                     char                     *buffer,
+                                     unsigned int              size);
+
     QI_API void log(const qi::log::LogLevel verb,
                     const char              *category,
                     const char              *msg,
@@ -144,35 +450,163 @@ namespace qi {
 
     QI_API qi::log::LogLevel verbosity();
 
+    QI_API qi::log::LogLevel verbosity(const std::string &category);
+
+    QI_API void setCategoryVerbosity(const std::string &pattern,
+                                     const qi::log::LogLevel lv);
+
+    QI_API void clearCategoryVerbosity();
+
 
     QI_API void setContext(int ctx);
 
     QI_API int context();
 
+    QI_API void setLogPattern(const std::string &pattern);
+
     QI_API void setSynchronousLog(bool sync);
 
+    QI_API void setDeferredFormatting(bool deferred);
+
+    QI_API void setOverflowPolicy(qi::log::LogOverflowPolicy policy,
+                                  unsigned int blockTimeout = 100);
+
+    QI_API qi::log::LogOverflowPolicy overflowPolicy();
+
+    QI_API void setTimestampClock(qi::log::LogClock clock);
+
+    QI_API qi::log::LogClock timestampClock();
+
+    QI_API void setWakeup(unsigned int maxLatency, unsigned int spin = 0);
+
+    QI_API void setBufferSize(unsigned int bytes);
+
+    QI_API void setRateLimit(const qi::log::LogLevel verb,
+                             unsigned int rate,
+                             unsigned int burst = 1);
+
+    QI_API void setRepeatSuppression(const qi::log::LogLevel verb, bool collapse);
+
+    QI_API unsigned int bufferSize();
+
+    /// A log statement, see callSites().
+    struct LogCallSite
+    {
+      const char   *file;
+      const char   *function;
+      int           line;
+      const char   *category;
+      unsigned int  categoryId;
+    };
+
+    QI_API std::vector<qi::log::LogCallSite> callSites();
+
     QI_API void addLogHandler(const std::string& name,
-                              qi::log::logFuncHandler fct);
+                              qi::log::logFuncHandler fct,
+                              unsigned int queueSize = 0);
+
+    QI_API void addLogBatchHandler(const std::string& name,
+                                   qi::log::logBatchFuncHandler fct,
+                                   unsigned int queueSize = 0);
+
+    QI_API void setLogHandlerFlush(const std::string& name,
+                                   qi::log::logFlushFuncHandler fct);
+
+    /// Buckets of the duration histograms: bucket 0 counts the durations
+    /// under 1 us, bucket i those from 2^(i-1) to 2^i us, the last one
+    /// also counts the longer ones.
+    enum { LogHistogramSize = 24 };
+
+    /// Counters of a handler.
+    struct LogHandlerStats
+    {
+      std::string   name;
+      unsigned long delivered;
+      // with a queue, records dropped because it was full, and records
+      // queued and not handled yet
+      unsigned long dropped;
+      unsigned long lag;
+      // calls of the handler and their duration
+      unsigned long calls;
+      unsigned long time[LogHistogramSize];
+    };
+
+    QI_API qi::log::LogHandlerStats handlerStats(const std::string& name);
+
+    /// Records logged in a category.
+    struct LogCategoryStats
+    {
+      const char   *name;
+      unsigned long logged;
+    };
+
+    /// Snapshot of the log system counters, see stats().
+    struct LogStats
+    {
+      // records queued, dropped by the overflow policy and suppressed by
+      // the rate limits, since the start of the program
+      unsigned long logged[debug + 1];
+      unsigned long dropped[debug + 1];
+      unsigned long suppressed;
+      // records logged after the shutdown or not delivered by destroy()
+      unsigned long lost;
+      // threads rings: bytes waiting for the log thread and total size
+      unsigned int  rings;
+      unsigned long queuedBytes;
+      unsigned long ringBytes;
+      // duration from the log call to the delivery to the handlers
+      unsigned long latency[LogHistogramSize];
+      std::vector<qi::log::LogHandlerStats>  handlers;
+      std::vector<qi::log::LogCategoryStats> categories;
+    };
+
+    QI_API qi::log::LogStats stats();
+
+    QI_API void setStatsReport(unsigned int interval);
+
+    QI_API void setShutdownTimeout(unsigned int timeout);
+
+    QI_API std::string setCrashRing(unsigned int bytes, const std::string &path = "");
+
+    QI_API bool readCrashRing(const std::string &path,
+                              qi::log::logBatchFuncHandler fct,
+                              unsigned int last = 0);
 
     QI_API void removeLogHandler(const std::string& name);
 
     QI_API void flush();
 
-    class LogStream: public std::stringstream
+    QI_API bool flush(unsigned int timeout);
+
+    QI_API unsigned long droppedLogs();
+
+    QI_API unsigned long droppedLogs(const qi::log::LogLevel verb);
+
+    QI_API unsigned long suppressedLogs();
+
+    class LogStream: public std::ostream
     {
     public:
 
       LogStream(const LogStream &rhs)
-        : _logLevel(rhs._logLevel)
+        : std::basic_ios<char>()
+        , std::ostream(0)
+        , _site(rhs._site)
+        , _logLevel(rhs._logLevel)
         , _category(rhs._category)
         , _file(rhs._file)
         , _function(rhs._function)
         , _line(rhs._line)
       {
+        rdbuf(&_buffer);
+        _args.fmt = 0;
+        _fields.size = 0;
+        _fields.count = 0;
       }
 
       LogStream &operator=(const LogStream &rhs)
       {
+        _site     = rhs._site;
         _logLevel = rhs._logLevel;
         _category = rhs._category;
         _file     = rhs._file;
@@ -186,12 +620,18 @@ namespace qi {
                 const char        *function,
                 const int         line,
                 const char        *category)
-        : _logLevel(level)
+        : std::ostream(0)
+        , _site(0)
+        , _logLevel(level)
         , _category(category)
         , _file(file)
         , _function(function)
         , _line(line)
       {
+        rdbuf(&_buffer);
+        _args.fmt = 0;
+        _fields.size = 0;
+        _fields.count = 0;
       }
 
       LogStream(const LogLevel    level,
@@ -200,40 +640,157 @@ namespace qi {
                 const int         line,
                 const char        *category,
                 const char        *fmt, ...)
-        : _logLevel(level)
+        : std::ostream(0)
+        , _site(0)
+        , _logLevel(level)
+        , _category(category)
+        , _file(file)
+        , _function(function)
+        , _line(line)
+      {
+        rdbuf(&_buffer);
+        _args.fmt = 0;
+        _fields.size = 0;
+        _fields.count = 0;
+        va_list vl;
+        va_start(vl, fmt);
+        _buffer.vprintf(fmt, vl);
+        va_end(vl);
+      }
+
+      LogStream(const LogLevel          level,
+                const detail::CallSite *site,
+                const char              *file,
+                const char              *function,
+                const int               line,
+                const char              *category)
+        : std::ostream(0)
+        , _site(site)
+        , _logLevel(level)
         , _category(category)
         , _file(file)
         , _function(function)
         , _line(line)
       {
-        char buffer[2048];
+        rdbuf(&_buffer);
+        _args.fmt = 0;
+        _fields.size = 0;
+        _fields.count = 0;
+      }
+
+      LogStream(const LogLevel          level,
+                const detail::CallSite *site,
+                const char              *file,
+                const char              *function,
+                const int               line,
+                const char              *category,
+                const char              *fmt, ...)
+        : std::ostream(0)
+        , _site(site)
+        , _logLevel(level)
+        , _category(category)
+        , _file(file)
+        , _function(function)
+        , _line(line)
+      {
+        rdbuf(&_buffer);
+        _fields.size = 0;
+        _fields.count = 0;
         va_list vl;
         va_start(vl, fmt);
-       #ifdef _MSC_VER
-        vsnprintf_s(buffer, 2048, 2047, fmt, vl);
-       #else
-        vsnprintf(buffer, 2048, fmt, vl);
-       #endif
-        buffer[2047] = 0;
+        bool captured = detail::deferredFormatting && detail::captureArgs(&_args, fmt, vl);
         va_end(vl);
-        *this << buffer;
+        if (!captured)
+        {
+          _args.fmt = 0;
+          va_start(vl, fmt);
+          _buffer.vprintf(fmt, vl);
+          va_end(vl);
+        }
       }
 
       ~LogStream()
       {
-        qi::log::log(_logLevel, _category, this->str().c_str(), _file, _function, _line);
+        if (_site || _fields.count)
+          detail::log(_site, _logLevel, _category, _buffer.c_str(), _file, _function, _line,
+                      _args.fmt ? &_args : 0, _fields.count ? &_fields : 0);
+        else
+          qi::log::log(_logLevel, _category, _buffer.c_str(), _file, _function, _line);
       }
 
       LogStream& self() {
         return *this;
       }
 
+      // Typed fields, kept in binary form up to the handlers. They must
+      // come before the streamed text, kv() returns the LogStream.
+      LogStream& kv(const char *key, int value)                { return intField(key, value); }
+      LogStream& kv(const char *key, long value)               { return intField(key, value); }
+      LogStream& kv(const char *key, long long value)          { return intField(key, value); }
+      LogStream& kv(const char *key, unsigned int value)       { return uintField(key, value); }
+      LogStream& kv(const char *key, unsigned long value)      { return uintField(key, value); }
+      LogStream& kv(const char *key, unsigned long long value) { return uintField(key, value); }
+
+      LogStream& kv(const char *key, double value)
+      {
+        LogField field;
+        field.type = doubleField;
+        field.value.d = value;
+        detail::addField(&_fields, key, field);
+        return *this;
+      }
+
+      LogStream& kv(const char *key, bool value)
+      {
+        LogField field;
+        field.type = boolField;
+        field.value.b = value;
+        detail::addField(&_fields, key, field);
+        return *this;
+      }
+
+      LogStream& kv(const char *key, const char *value)
+      {
+        LogField field;
+        field.type = stringField;
+        field.value.s = value;
+        detail::addField(&_fields, key, field);
+        return *this;
+      }
+
+      LogStream& kv(const char *key, const std::string &value)
+      {
+        return kv(key, value.c_str());
+      }
+
     private:
+      LogStream& intField(const char *key, boost::int64_t value)
+      {
+        LogField field;
+        field.type = qi::log::intField;
+        field.value.i = value;
+        detail::addField(&_fields, key, field);
+        return *this;
+      }
+
+      LogStream& uintField(const char *key, boost::uint64_t value)
+      {
+        LogField field;
+        field.type = qi::log::uintField;
+        field.value.u = value;
+        detail::addField(&_fields, key, field);
+        return *this;
+      }
+
+      const detail::CallSite *_site;
       LogLevel    _logLevel;
       const char *_category;
       const char *_file;
       const char *_function;
       int         _line;
+      detail::LogStreamBuf _buffer;
+      detail::LogArgs      _args;
+      detail::LogFields    _fields;
     };
   }
 }
@@ -25,6 +25,7 @@ namespace qi {
     {
     public:
       ConsoleLogHandler();
+      ~ConsoleLogHandler();
 
       void log(const qi::log::LogLevel verb,
                const qi::os::timeval   date,
@@ -34,6 +35,16 @@ namespace qi {
                const char              *fct,
                const int               line);
 
+      void logBatch(const qi::log::LogRecord *records, unsigned int count);
+
+      void setBatching(bool batching);
+
+      bool setNonBlocking(bool nonBlocking, unsigned int bufferSize = 256 * 1024);
+
+      unsigned long droppedLines() const;
+
+      void flush();
+
 
     protected:
       QI_DISALLOW_COPY_AND_ASSIGN(ConsoleLogHandler);
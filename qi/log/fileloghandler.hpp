@@ -15,13 +15,33 @@ namespace qi {
   namespace log {
     class PrivateFileLogHandler;
 
+    /** \brief How a FileLogHandler trades durability for throughput
+     *  \ingroup qilog
+     */
+    struct QI_API FileLogPolicy
+    {
+      /// 64kB buffer, written at least every second, errors at once, no sync.
+      FileLogPolicy();
+
+      /// Bytes gathered before a write, 0 to write each line.
+      unsigned int bufferSize;
+      /// Milliseconds a line may wait in the buffer, 0 for no limit.
+      unsigned int flushInterval;
+      /// Records at this level or more severe are written at once.
+      LogLevel     flushLevel;
+      /// Milliseconds between two fdatasync of what was written, 0 for none.
+      unsigned int syncInterval;
+    };
+
     /** \brief log to file handler
      *  \ingroup qilog
      */
     class QI_API FileLogHandler
     {
     public:
+      /// Write each line as it comes.
       explicit FileLogHandler(const std::string& filePath);
+      FileLogHandler(const std::string& filePath, const FileLogPolicy& policy);
       virtual ~FileLogHandler();
 
       void log(const qi::log::LogLevel verb,
@@ -32,6 +52,11 @@ namespace qi {
                const char              *fct,
                const int               line);
 
+      void logBatch(const qi::log::LogRecord *records, unsigned int count);
+
+      /// Write what the buffer holds.
+      void flush();
+
     private:
       QI_DISALLOW_COPY_AND_ASSIGN(FileLogHandler);
       PrivateFileLogHandler* _private;
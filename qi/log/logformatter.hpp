@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2012 Aldebaran Robotics. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the COPYING file.
+ */
+
+#pragma once
+#ifndef _LIBQI_QI_LOG_LOGFORMATTER_HPP_
+#define _LIBQI_QI_LOG_LOGFORMATTER_HPP_
+
+# include <qi/log.hpp>
+# include <string>
+
+namespace qi {
+  namespace log {
+    class PrivateLogFormatter;
+
+    /** \brief Render log lines from a layout pattern
+     *  \ingroup qilog
+     */
+    class QI_API LogFormatter
+    {
+    public:
+      LogFormatter();
+      explicit LogFormatter(const std::string& pattern);
+      ~LogFormatter();
+
+      unsigned int format(char                    *buffer,
+                          unsigned int             size,
+                          const qi::log::LogLevel  verb,
+                          const qi::os::timeval    date,
+                          const char              *category,
+                          const char              *msg,
+                          const char              *file,
+                          const char              *fct,
+                          const int                line,
+                          unsigned int            *levelBegin = 0,
+                          unsigned int            *levelEnd = 0);
+
+      unsigned int format(char                     *buffer,
+                          unsigned int              size,
+                          const qi::log::LogRecord &record,
+                          unsigned int             *levelBegin = 0,
+                          unsigned int             *levelEnd = 0);
+
+    private:
+      QI_DISALLOW_COPY_AND_ASSIGN(LogFormatter);
+      PrivateLogFormatter* _private;
+    }; // !LogFormatter
+
+  }; // !log
+}; // !qi
+
+#endif  // _LIBQI_QI_LOG_LOGFORMATTER_HPP_
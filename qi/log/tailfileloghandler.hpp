@@ -15,14 +15,20 @@ namespace qi {
   namespace log {
     class PrivateTailFileLogHandler;
 
-    /** \brief Log the \a length first lines to file.
+    /** \brief Log the last lines to file.
      *  \ingroup qilog
      *
+     *  Past \a maxSize bytes the file is renamed to filePath.1, the older
+     *  ones to filePath.2 and so on up to \a generations, and a new file
+     *  is started. Logging never waits for the renames: meanwhile, or if
+     *  the file cannot be renamed, the lines go on in the current file.
      */
     class QI_API TailFileLogHandler
     {
     public:
-      TailFileLogHandler(const std::string &filePath);
+      TailFileLogHandler(const std::string &filePath,
+                         unsigned int       maxSize = 1024 * 1024,
+                         unsigned int       generations = 1);
       virtual ~TailFileLogHandler();
 
       void log(const qi::log::LogLevel verb,
@@ -33,6 +39,8 @@ namespace qi {
                const char              *fct,
                const int               line);
 
+      void flush();
+
     private:
       QI_DISALLOW_COPY_AND_ASSIGN(TailFileLogHandler);
       PrivateTailFileLogHandler* _private;
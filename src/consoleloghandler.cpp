@@ -4,13 +4,19 @@
  * found in the COPYING file.
  */
 
-#include <sstream>
+#include <algorithm>
 #include <cstdlib>
 #include <cstring>
 #include <cstdio>
+#include <string>
 #include <qi/os.hpp>
 #include <qi/log.hpp>
 #include <qi/log/consoleloghandler.hpp>
+#include <qi/log/logformatter.hpp>
+#include "logoutput.hpp"
+
+#include <boost/atomic.hpp>
+#include <boost/thread/mutex.hpp>
 
 #ifdef _WIN32
 # include <windows.h>
@@ -18,9 +24,17 @@
 # define isatty _isatty
 #else
 # include <unistd.h>
+# include <errno.h>
+# include <fcntl.h>
+# include <sys/socket.h>
+# include <sys/stat.h>
+# include <sys/uio.h>
 #endif
 
-#define CATSIZEMAX 16
+// lines written at once by logBatch
+#define BATCHSIZEMAX (64 * 1024)
+// what a non-blocking console holds back at least: a batch and the marker
+#define PENDINGSIZEMIN (BATCHSIZEMAX + 64)
 
 namespace qi {
   namespace log {
@@ -79,50 +93,293 @@ namespace qi {
 #endif
 
 
-      void textColorBG(char bg) const;
+#ifdef _WIN32
       void textColorFG(char fg) const;
       void textColorAttr(char attr) const;
-      void header(const LogLevel verb) const;
+      void levelColor(const LogLevel verb) const;
+#else
+      // escape sequences, empty without color
+      std::string textColorFG(char fg) const;
+      std::string textColorAttr(char attr) const;
+      std::string levelColor(const LogLevel verb) const;
+#endif
+      void write(const char   *line,
+                 unsigned int  size,
+                 unsigned int  levelBegin,
+                 unsigned int  levelEnd,
+                 LogLevel      verb);
+      void writeBatch();
+#ifndef _WIN32
+      void output(struct iovec *iov, int count);
+      void writeNonBlocking(struct iovec *iov, int count);
+      ssize_t writeOut(struct iovec *iov, int count);
+      void writePending();
+      void drop(const struct iovec *iov, int count);
+      void closeNonBlocking();
+#endif
 
       bool _color;
+      // gather the lines of a batch in a single write
+      bool _batching;
+      LogFormatter _formatter;
+      char *_batch;
+      unsigned int _batchSize;
 
 #ifdef _WIN32
       void* _winScreenHandle;
+#else
+      // computed once: set before the level of each verbosity, and after it
+      std::string _levelColor[debug + 1];
+      std::string _textColor;
+
+      // non-blocking output, -1 when writing on the standard output
+      int _fd;
+      // _fd is a socket, each send says not to wait
+      bool _socket;
+      // what the reader did not take yet, from _pendingBegin
+      char *_pending;
+      unsigned int _pendingBegin;
+      unsigned int _pendingSize;
+      unsigned int _pendingCapacity;
+      // lines dropped since the last marker
+      unsigned long _droppedLines;
+      boost::mutex _pendingLock;
 #endif
+      boost::atomic<unsigned long> _dropped;
     };
 
 
 #ifndef _WIN32
-    void PrivateConsoleLogHandler::textColorAttr(char attr) const
+    std::string PrivateConsoleLogHandler::textColorAttr(char attr) const
     {
       if (!_color)
-        return;
+        return std::string();
 
-      printf("%c[%dm", 0x1B, attr);
+      char seq[16];
+      snprintf(seq, sizeof(seq), "%c[%dm", 0x1B, attr);
+      return seq;
     }
 
-    void PrivateConsoleLogHandler::textColorBG(char bg) const
+    std::string PrivateConsoleLogHandler::textColorFG(char fg) const
     {
       if (!_color)
+        return std::string();
+
+      char seq[16];
+      snprintf(seq, sizeof(seq), "%c[%dm", 0x1B, fg + 30);
+      return seq;
+    }
+
+    std::string PrivateConsoleLogHandler::levelColor(const LogLevel verb) const
+    {
+      std::string seq = textColorAttr(reset);
+      if (verb == fatal)
+        seq += textColorFG(magenta);
+      if (verb == error)
+        seq += textColorFG(red);
+      if (verb == warning)
+        seq += textColorFG(yellow);
+      if (verb == info)
+        seq += textColorAttr(reset);
+      if (verb == verbose)
+        seq += textColorAttr(dim);
+      if (verb == debug)
+        seq += textColorAttr(dim);
+      return seq;
+    }
+
+    // Write the iovecs on the standard output, whatever it takes.
+    static unsigned long countLines(const struct iovec *iov, int count)
+    {
+      unsigned long lines = 0;
+      for (int i = 0; i < count; ++i)
+      {
+        const char *begin = static_cast<const char*>(iov[i].iov_base);
+        lines += std::count(begin, begin + iov[i].iov_len, '\n');
+      }
+      return lines ? lines : 1;
+    }
+
+    void PrivateConsoleLogHandler::drop(const struct iovec *iov, int count)
+    {
+      unsigned long lines = countLines(iov, count);
+      _droppedLines += lines;
+      _dropped.fetch_add(lines);
+    }
+
+    // A dup of a socket shares its flags with the standard output: it
+    // stays blocking and the sends do not wait instead.
+    ssize_t PrivateConsoleLogHandler::writeOut(struct iovec *iov, int count)
+    {
+      if (!_socket)
+        return ::writev(_fd, iov, count);
+      struct msghdr msg;
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = iov;
+      msg.msg_iovlen = count;
+      return ::sendmsg(_fd, &msg, MSG_DONTWAIT);
+    }
+
+    // As much of the pending buffer as the reader takes right now. When
+    // the output is broken for good, the buffer is dropped.
+    void PrivateConsoleLogHandler::writePending()
+    {
+      while (_pendingSize)
+      {
+        struct iovec pending;
+        pending.iov_base = _pending + _pendingBegin;
+        pending.iov_len = _pendingSize;
+        ssize_t n = writeOut(&pending, 1);
+        if (n < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          if (errno != EAGAIN && errno != EWOULDBLOCK)
+          {
+            drop(&pending, 1);
+            _pendingBegin = _pendingSize = 0;
+          }
+          return;
+        }
+        _pendingBegin += n;
+        _pendingSize -= n;
+      }
+      _pendingBegin = 0;
+    }
+
+    // Never wait for the reader. What the pipe does not take waits in the
+    // pending buffer; while it is not empty, new lines are appended to it,
+    // or dropped when they do not fit. The first write that goes through
+    // afterward starts with a marker counting the dropped lines.
+    void PrivateConsoleLogHandler::writeNonBlocking(struct iovec *iov, int count)
+    {
+      boost::mutex::scoped_lock l(_pendingLock);
+      unsigned int size = 0;
+      for (int i = 0; i < count; ++i)
+        size += iov[i].iov_len;
+
+      writePending();
+      if (_pendingSize)
+      {
+        if (_pendingSize + size > _pendingCapacity)
+        {
+          drop(iov, count);
+          return;
+        }
+        if (_pendingBegin + _pendingSize + size > _pendingCapacity)
+        {
+          memmove(_pending, _pending + _pendingBegin, _pendingSize);
+          _pendingBegin = 0;
+        }
+        for (int i = 0; i < count; ++i)
+        {
+          memcpy(_pending + _pendingBegin + _pendingSize, iov[i].iov_base, iov[i].iov_len);
+          _pendingSize += iov[i].iov_len;
+        }
         return;
+      }
 
-      printf("%c[%dm", 0x1B, bg + 40);
+      struct iovec all[6];
+      char marker[64];
+      int n = 0;
+      if (_droppedLines)
+      {
+        all[n].iov_base = marker;
+        all[n].iov_len = snprintf(marker, sizeof(marker),
+                                  "qi.log: %lu lines dropped\n", _droppedLines);
+        _droppedLines = 0;
+        ++n;
+      }
+      for (int i = 0; i < count; ++i)
+        all[n++] = iov[i];
+
+      ssize_t written;
+      do
+        written = writeOut(all, n);
+      while (written < 0 && errno == EINTR);
+      if (written < 0)
+      {
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+          drop(iov, count);
+          return;
+        }
+        written = 0;
+      }
+
+      // the rest of a started line must follow it, and always fits
+      for (int i = 0; i < n; ++i)
+      {
+        if ((size_t)written >= all[i].iov_len)
+        {
+          written -= all[i].iov_len;
+          continue;
+        }
+        memcpy(_pending + _pendingSize,
+               static_cast<char*>(all[i].iov_base) + written,
+               all[i].iov_len - written);
+        _pendingSize += all[i].iov_len - written;
+        written = 0;
+      }
     }
 
-    void PrivateConsoleLogHandler::textColorFG(char fg) const
+    void PrivateConsoleLogHandler::output(struct iovec *iov, int count)
     {
-      if (!_color)
+      if (_fd >= 0)
+      {
+        writeNonBlocking(iov, count);
         return;
+      }
+      // what was printed with stdio comes first
+      fflush(stdout);
+      detail::writeAll(1, iov, count);
+    }
 
-      printf("%c[%dm", 0x1B, fg + 30);
+    // Last chance for the pending lines, then back to the standard output.
+    void PrivateConsoleLogHandler::closeNonBlocking()
+    {
+      if (_fd < 0)
+        return;
+      writePending();
+      ::close(_fd);
+      delete[] _pending;
+      _fd = -1;
+      _socket = false;
+      _pending = 0;
+      _pendingBegin = _pendingSize = _pendingCapacity = 0;
     }
 
-#else
-    void PrivateConsoleLogHandler::textColorBG(char bg) const
+    // The level in color, the rest in gray, in a single system call.
+    void PrivateConsoleLogHandler::write(const char   *line,
+                                         unsigned int  size,
+                                         unsigned int  levelBegin,
+                                         unsigned int  levelEnd,
+                                         LogLevel      verb)
     {
-      return;
+      if (!_color)
+      {
+        struct iovec iov;
+        iov.iov_base = const_cast<char*>(line);
+        iov.iov_len = size;
+        output(&iov, 1);
+        return;
+      }
+
+      struct iovec iov[5];
+      iov[0].iov_base = const_cast<char*>(line);
+      iov[0].iov_len = levelBegin;
+      iov[1].iov_base = const_cast<char*>(_levelColor[verb].data());
+      iov[1].iov_len = _levelColor[verb].size();
+      iov[2].iov_base = const_cast<char*>(line + levelBegin);
+      iov[2].iov_len = levelEnd - levelBegin;
+      iov[3].iov_base = const_cast<char*>(_textColor.data());
+      iov[3].iov_len = _textColor.size();
+      iov[4].iov_base = const_cast<char*>(line + levelEnd);
+      iov[4].iov_len = size - levelEnd;
+      output(iov, 5);
     }
 
+#else
     void PrivateConsoleLogHandler::textColorAttr(char attr) const
     {
       textColorFG(attr);
@@ -144,11 +401,9 @@ namespace qi {
       }
       return;
     }
-#endif
 
-    void PrivateConsoleLogHandler::header(const LogLevel verb) const
+    void PrivateConsoleLogHandler::levelColor(const LogLevel verb) const
     {
-      //display log level
       textColorAttr(reset);
       if (verb == fatal)
         textColorFG(magenta);
@@ -162,8 +417,38 @@ namespace qi {
         textColorAttr(dim);
       if (verb == debug)
         textColorAttr(dim);
-      printf("%s ", logLevelToString(verb));
+    }
+
+    // The console colors are not part of the text.
+    void PrivateConsoleLogHandler::write(const char   *line,
+                                         unsigned int  size,
+                                         unsigned int  levelBegin,
+                                         unsigned int  levelEnd,
+                                         LogLevel      verb)
+    {
+      if (!_color)
+      {
+        fwrite(line, 1, size, stdout);
+        fflush(stdout);
+        return;
+      }
+      fwrite(line, 1, levelBegin, stdout);
+      fflush(stdout);
+      levelColor(verb);
+      fwrite(line + levelBegin, 1, levelEnd - levelBegin, stdout);
+      fflush(stdout);
       textColorAttr(reset);
+      fwrite(line + levelEnd, 1, size - levelEnd, stdout);
+      fflush(stdout);
+    }
+#endif
+
+    void PrivateConsoleLogHandler::writeBatch()
+    {
+      if (!_batchSize)
+        return;
+      write(_batch, _batchSize, 0, 0, silent);
+      _batchSize = 0;
     }
 
     ConsoleLogHandler::ConsoleLogHandler()
@@ -180,22 +465,99 @@ namespace qi {
         _private->_color = atoi(color) > 0 ? true: false;
       if (!isatty(1))
         _private->_color = 0;
+
+      // a terminal shows each line as it comes
+      _private->_batching = !isatty(1);
+      _private->_batch = new char[BATCHSIZEMAX];
+      _private->_batchSize = 0;
+      _private->_dropped.store(0);
+#ifndef _WIN32
+      _private->_fd = -1;
+      _private->_socket = false;
+      _private->_pending = 0;
+      _private->_pendingBegin = 0;
+      _private->_pendingSize = 0;
+      _private->_pendingCapacity = 0;
+      _private->_droppedLines = 0;
+      for (int i = silent; i <= debug; ++i)
+        _private->_levelColor[i] = _private->levelColor((LogLevel)i);
+      _private->_textColor = _private->textColorAttr(_private->reset)
+        + _private->textColorFG(_private->gray);
+#endif
+
+      const char *nonBlocking = std::getenv("CLINONBLOCK");
+      if (nonBlocking && atoi(nonBlocking) > 0)
+        setNonBlocking(true);
     }
 
-    void cutCat(const char* category, char* res)
+    ConsoleLogHandler::~ConsoleLogHandler()
     {
-      int categorySize = strlen(category);
-      if (categorySize < CATSIZEMAX)
-      {
-        memset(res, ' ', CATSIZEMAX);
-        memcpy(res, category, strlen(category));
-      }
+#ifndef _WIN32
+      _private->closeNonBlocking();
+#endif
+      delete[] _private->_batch;
+      delete _private;
+    }
+
+    // Without waiting for the reader either: what it does not take stays
+    // pending.
+    void ConsoleLogHandler::flush()
+    {
+#ifndef _WIN32
+      boost::mutex::scoped_lock l(_private->_pendingLock);
+      if (_private->_fd >= 0)
+        _private->writePending();
+#endif
+    }
+
+    void ConsoleLogHandler::setBatching(bool batching)
+    {
+      _private->_batching = batching && !isatty(1);
+    }
+
+    bool ConsoleLogHandler::setNonBlocking(bool nonBlocking, unsigned int bufferSize)
+    {
+#ifdef _WIN32
+      return !nonBlocking;
+#else
+      boost::mutex::scoped_lock l(_private->_pendingLock);
+      _private->closeNonBlocking();
+      if (!nonBlocking)
+        return true;
+
+      // a regular file never makes us wait
+      struct stat st;
+      if (fstat(1, &st) != 0)
+        return false;
+      if (S_ISREG(st.st_mode))
+        return true;
+
+      // O_NONBLOCK on the standard output itself would make the stdio
+      // writes of the whole process fail, and a dup shares it. A dup is
+      // fine for a socket, which can be told not to wait on each send, or
+      // for an output that does not block already. Anything else, a pipe
+      // or a terminal, is reopened to get a file description of our own,
+      // which needs /proc (Linux).
+      int flags = fcntl(1, F_GETFL);
+      int fd;
+      if (S_ISSOCK(st.st_mode) || (flags >= 0 && (flags & O_NONBLOCK)))
+        fd = ::dup(1);
       else
-      {
-        memset(res, '.', CATSIZEMAX);
-        memcpy(res + 3, category + categorySize - CATSIZEMAX + 3, CATSIZEMAX - 3);
-      }
-      res[CATSIZEMAX] = '\0';
+        fd = ::open("/proc/self/fd/1", O_WRONLY | O_APPEND | O_NONBLOCK);
+      if (fd < 0)
+        return false;
+      fcntl(fd, F_SETFD, FD_CLOEXEC);
+      _private->_fd = fd;
+      _private->_socket = S_ISSOCK(st.st_mode);
+      _private->_pendingCapacity = std::max(bufferSize, (unsigned int)PENDINGSIZEMIN);
+      _private->_pending = new char[_private->_pendingCapacity];
+      return true;
+#endif
+    }
+
+    unsigned long ConsoleLogHandler::droppedLines() const
+    {
+      return _private->_dropped.load();
     }
 
     void ConsoleLogHandler::log(const LogLevel        verb,
@@ -206,56 +568,42 @@ namespace qi {
                                 const char            *fct,
                                 const int             line)
     {
-      if (verb > qi::log::verbosity())
+      char *buffer = detail::lineBuffer();
+      unsigned int levelBegin;
+      unsigned int levelEnd;
+      unsigned int size = _private->_formatter.format(buffer, LINESIZEMAX,
+                                                      verb, date, category, msg,
+                                                      file, fct, line,
+                                                      &levelBegin, &levelEnd);
+      _private->write(buffer, size, levelBegin, levelEnd, verb);
+    }
+
+    // Synchronous logs come one by one from any thread. The batches of the
+    // log thread come one at a time and can share the batch buffer.
+    void ConsoleLogHandler::logBatch(const LogRecord *records, unsigned int count)
+    {
+      if (count == 1 || !_private->_batching)
       {
+        char *buffer = detail::lineBuffer();
+        for (unsigned int i = 0; i < count; ++i)
+        {
+          unsigned int levelBegin;
+          unsigned int levelEnd;
+          unsigned int size = _private->_formatter.format(buffer, LINESIZEMAX, records[i],
+                                                          &levelBegin, &levelEnd);
+          _private->write(buffer, size, levelBegin, levelEnd, records[i].level);
+        }
         return;
       }
-      else
-      {
-        _private->header(verb);
-        char fixedCategory[CATSIZEMAX + 1];
-        fixedCategory[CATSIZEMAX] = '\0';
-        cutCat(category, fixedCategory);
-#ifndef WIN32
-        _private->textColorAttr(_private->reset);
-        _private->textColorFG(_private->gray);
-#endif
-
-        std::stringstream ss;
-        ss << date.tv_sec << "." << date.tv_usec;
 
-        int ctx = qi::log::context();
-        switch (ctx)
-        {
-        case 1:
-          printf("%s: ", fixedCategory);
-          break;
-        case 2:
-          printf("%s ", ss.str().c_str());
-          break;
-        case 3:
-          printf("%s(%d) ", file, line);
-          break;
-        case 4:
-          printf("%s %s: ", ss.str().c_str(), fixedCategory);
-          break;
-        case 5:
-          printf("%s %s(%d) ", ss.str().c_str(), file, line);
-          break;
-        case 6:
-          printf("%s: %s(%d) ", fixedCategory, file, line);
-          break;
-        case 7:
-          printf("%s %s: %s(%d) %s ", ss.str().c_str(), fixedCategory, file, line, fct);
-          break;
-        default:
-          break;
-        }
-        printf("%s", msg);
-        fflush (stdout);
+      for (unsigned int i = 0; i < count; ++i)
+      {
+        if (_private->_batchSize + LINESIZEMAX > BATCHSIZEMAX)
+          _private->writeBatch();
+        _private->_batchSize += _private->_formatter.format(_private->_batch + _private->_batchSize,
+                                                           LINESIZEMAX, records[i]);
       }
-      fflush (stdout);
+      _private->writeBatch();
     }
   }
 }
-
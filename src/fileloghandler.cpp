@@ -5,34 +5,71 @@
  */
 
 #include <qi/log/fileloghandler.hpp>
+#include <qi/log/logformatter.hpp>
+#include "logoutput.hpp"
 
 #include <boost/function.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/bind.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
 
-#include <sstream>
+#include <algorithm>
 #include <string>
 #include <qi/log.hpp>
 #include <qi/os.hpp>
 #include <cstdio>
 
-#define CATSIZEMAX 16
+#ifdef _WIN32
+# include <io.h>
+#else
+# include <errno.h>
+# include <fcntl.h>
+# include <unistd.h>
+#endif
 
 namespace qi {
   namespace log {
     class PrivateFileLogHandler
     {
     public:
-      void cutCat(const char* category, char* res);
+      void open(const std::string &filePath);
+      void append(const char *data, unsigned int size);
+      void writeBuffer();
+      void sync();
+      void run();
 
       FILE* _file;
+      int _fd;
+      LogFormatter _formatter;
+      FileLogPolicy _policy;
+
+      boost::mutex _lock;
+      char *_buffer;
+      unsigned int _capacity;
+      unsigned int _size;
+      // written since the last sync
+      bool _dirty;
+
+      // flushes and syncs on the intervals of the policy
+      boost::thread _timer;
+      boost::condition_variable _timerCond;
+      bool _stop;
     };
 
+    FileLogPolicy::FileLogPolicy()
+      : bufferSize(64 * 1024)
+      , flushInterval(1000)
+      , flushLevel(error)
+      , syncInterval(0)
+    {
+    }
 
-    FileLogHandler::FileLogHandler(const std::string& filePath)
-      : _private(new PrivateFileLogHandler)
+    void PrivateFileLogHandler::open(const std::string &filePath)
     {
-      _private->_file = NULL;
+      _file = NULL;
+      _fd = -1;
       boost::filesystem::path fPath(filePath);
       // Create the directory!
       try
@@ -45,38 +82,125 @@ namespace qi {
         qiLogWarning("qi.log.fileloghandler") << e.what() << std::endl;
       }
 
-      // Open the file.
+      // Open the file. Only its descriptor is used, stdio buffers nothing.
       FILE* file = qi::os::fopen(fPath.make_preferred().string().c_str(), "w+");
 
       if (file)
-        _private->_file = file;
+      {
+        _file = file;
+        _fd = fileno(file);
+#ifndef _WIN32
+        // each write lands at the end, even with other writers
+        fcntl(_fd, F_SETFL, fcntl(_fd, F_GETFL) | O_APPEND);
+#endif
+      }
       else
         qiLogWarning("qi.log.fileloghandler") << "Cannot open "
                                               << filePath << std::endl;
     }
 
-    FileLogHandler::~FileLogHandler()
+    void PrivateFileLogHandler::append(const char *data, unsigned int size)
     {
-      if (_private->_file != NULL)
-        fclose(_private->_file);
+      detail::writeAll(_fd, data, size);
+      _dirty = true;
+    }
+
+    void PrivateFileLogHandler::writeBuffer()
+    {
+      if (!_size)
+        return;
+      append(_buffer, _size);
+      _size = 0;
+    }
+
+    void PrivateFileLogHandler::sync()
+    {
+#if defined(_WIN32)
+      _commit(_fd);
+#elif defined(__linux__)
+      fdatasync(_fd);
+#else
+      fsync(_fd);
+#endif
     }
 
-    void PrivateFileLogHandler::cutCat(const char* category, char* res)
+    // A line waits at most flushInterval, and the lines written meanwhile
+    // share one sync every syncInterval. The sync is done out of the lock,
+    // the logging threads go on filling the buffer.
+    void PrivateFileLogHandler::run()
     {
-      int categorySize = strlen(category);
-      if (categorySize < CATSIZEMAX)
+      unsigned int period = _policy.flushInterval;
+      if (_policy.syncInterval && (!period || _policy.syncInterval < period))
+        period = _policy.syncInterval;
+      boost::system_time nextSync = boost::get_system_time()
+        + boost::posix_time::milliseconds(_policy.syncInterval);
+
+      boost::mutex::scoped_lock l(_lock);
+      while (!_stop)
       {
-        memset(res, ' ', CATSIZEMAX);
-        memcpy(res, category, strlen(category));
+        _timerCond.timed_wait(l, boost::posix_time::milliseconds(period));
+        if (_policy.flushInterval)
+          writeBuffer();
+        if (_policy.syncInterval && _dirty && boost::get_system_time() >= nextSync)
+        {
+          _dirty = false;
+          l.unlock();
+          sync();
+          l.lock();
+          nextSync = boost::get_system_time()
+            + boost::posix_time::milliseconds(_policy.syncInterval);
+        }
       }
-      else
+    }
+
+    FileLogHandler::FileLogHandler(const std::string& filePath)
+      : _private(new PrivateFileLogHandler)
+    {
+      _private->_policy.bufferSize = 0;
+      _private->_policy.flushInterval = 0;
+      _private->_buffer = 0;
+      _private->_capacity = 0;
+      _private->_size = 0;
+      _private->_dirty = false;
+      _private->_stop = false;
+      _private->open(filePath);
+    }
+
+    FileLogHandler::FileLogHandler(const std::string& filePath, const FileLogPolicy& policy)
+      : _private(new PrivateFileLogHandler)
+    {
+      _private->_policy = policy;
+      // room for a whole line, formatted in place
+      _private->_capacity = policy.bufferSize ? std::max(policy.bufferSize, (unsigned int)LINESIZEMAX) : 0;
+      _private->_buffer = _private->_capacity ? new char[_private->_capacity] : 0;
+      _private->_size = 0;
+      _private->_dirty = false;
+      _private->_stop = false;
+      _private->open(filePath);
+
+      if (_private->_fd >= 0 && ((_private->_capacity && policy.flushInterval) || policy.syncInterval))
+        _private->_timer = boost::thread(&PrivateFileLogHandler::run, _private);
+    }
+
+    FileLogHandler::~FileLogHandler()
+    {
       {
-        memset(res, '.', CATSIZEMAX);
-        memcpy(res + 3, category + categorySize - CATSIZEMAX + 3, CATSIZEMAX - 3);
+        boost::mutex::scoped_lock l(_private->_lock);
+        _private->_stop = true;
+        _private->_timerCond.notify_one();
       }
-      res[CATSIZEMAX] = '\0';
-    }
+      _private->_timer.join();
 
+      if (_private->_file != NULL)
+      {
+        _private->writeBuffer();
+        if (_private->_policy.syncInterval)
+          _private->sync();
+        fclose(_private->_file);
+      }
+      delete[] _private->_buffer;
+      delete _private;
+    }
 
     void FileLogHandler::log(const qi::log::LogLevel verb,
                              const qi::os::timeval   date,
@@ -86,52 +210,71 @@ namespace qi {
                              const char              *fct,
                              const int               line)
     {
-      if (verb > qi::log::verbosity() || _private->_file == NULL)
+      if (_private->_file == NULL)
       {
         return;
       }
+      else if (!_private->_capacity)
+      {
+        char *buffer = detail::lineBuffer();
+        unsigned int size = _private->_formatter.format(buffer, LINESIZEMAX,
+                                                        verb, date, category, msg,
+                                                        file, fct, line);
+        boost::mutex::scoped_lock l(_private->_lock);
+        _private->append(buffer, size);
+      }
       else
       {
-        const char* head = logLevelToString(verb);
-        char fixedCategory[CATSIZEMAX + 1];
-        fixedCategory[CATSIZEMAX] = '\0';
-        _private->cutCat(category, fixedCategory);
+        boost::mutex::scoped_lock l(_private->_lock);
+        if (_private->_capacity - _private->_size < LINESIZEMAX)
+          _private->writeBuffer();
+        _private->_size += _private->_formatter.format(_private->_buffer + _private->_size,
+                                                       LINESIZEMAX,
+                                                       verb, date, category, msg,
+                                                       file, fct, line);
+        if (verb <= _private->_policy.flushLevel)
+          _private->writeBuffer();
+      }
+    }
 
-        std::stringstream ss;
-        ss << date.tv_sec << "." << date.tv_usec;
+    // The lines of a batch share the buffer and its lock.
+    void FileLogHandler::logBatch(const LogRecord *records, unsigned int count)
+    {
+      if (_private->_file == NULL)
+        return;
 
-        fprintf(_private->_file,"%s ", head);
-        int ctx = qi::log::context();
-        switch (ctx)
+      if (!_private->_capacity)
+      {
+        char *buffer = detail::lineBuffer();
+        for (unsigned int i = 0; i < count; ++i)
         {
-        case 1:
-          fprintf(_private->_file, "%s: ", fixedCategory);
-          break;
-        case 2:
-          fprintf(_private->_file, "%s ", ss.str().c_str());
-          break;
-        case 3:
-          fprintf(_private->_file, "%s(%d) ", file, line);
-          break;
-        case 4:
-          fprintf(_private->_file, "%s %s: ", ss.str().c_str(), fixedCategory);
-          break;
-        case 5:
-          fprintf(_private->_file, "%s %s(%d) ", ss.str().c_str(), file, line);
-          break;
-        case 6:
-          fprintf(_private->_file, "%s: %s(%d) ", fixedCategory, file, line);
-          break;
-        case 7:
-          fprintf(_private->_file, "%s %s: %s(%d) %s ", ss.str().c_str(), fixedCategory, file, line, fct);
-          break;
-        default:
-          break;
+          unsigned int size = _private->_formatter.format(buffer, LINESIZEMAX, records[i]);
+          boost::mutex::scoped_lock l(_private->_lock);
+          _private->append(buffer, size);
         }
-        fprintf(_private->_file,"%s", msg);
+        return;
+      }
 
-        fflush(_private->_file);
+      bool urgent = false;
+      boost::mutex::scoped_lock l(_private->_lock);
+      for (unsigned int i = 0; i < count; ++i)
+      {
+        if (_private->_capacity - _private->_size < LINESIZEMAX)
+          _private->writeBuffer();
+        _private->_size += _private->_formatter.format(_private->_buffer + _private->_size,
+                                                       LINESIZEMAX, records[i]);
+        if (records[i].level <= _private->_policy.flushLevel)
+          urgent = true;
       }
+      if (urgent)
+        _private->writeBuffer();
+    }
+
+    void FileLogHandler::flush()
+    {
+      boost::mutex::scoped_lock l(_private->_lock);
+      if (_private->_file != NULL)
+        _private->writeBuffer();
     }
   }
 }
@@ -5,27 +5,26 @@
  */
 
 #include <qi/log/headfileloghandler.hpp>
+#include <qi/log/logformatter.hpp>
+#include "logoutput.hpp"
 
 #include <boost/function.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/bind.hpp>
 
-#include <sstream>
 #include <string>
 #include <qi/log.hpp>
 #include <qi/os.hpp>
 #include <cstdio>
 
-#define CATSIZEMAX 16
 
 namespace qi {
   namespace log {
     class PrivateHeadFileLogHandler
     {
     public:
-      void cutCat(const char* category, char* res);
-
       FILE* _file;
+      LogFormatter _formatter;
       int   _count;
       int   _max;
     };
@@ -71,23 +70,6 @@ namespace qi {
         fclose(_private->_file);
     }
 
-    void PrivateHeadFileLogHandler::cutCat(const char* category, char* res)
-    {
-      int categorySize = strlen(category);
-      if (categorySize < CATSIZEMAX)
-      {
-        memset(res, ' ', CATSIZEMAX);
-        memcpy(res, category, strlen(category));
-      }
-      else
-      {
-        memset(res, '.', CATSIZEMAX);
-        memcpy(res + 3, category + categorySize - CATSIZEMAX + 3, CATSIZEMAX - 3);
-      }
-      res[CATSIZEMAX] = '\0';
-    }
-
-
     void HeadFileLogHandler::log(const qi::log::LogLevel verb,
                                  const qi::os::timeval   date,
                                  const char              *category,
@@ -98,49 +80,17 @@ namespace qi {
     {
       if (_private->_count < _private->_max)
       {
-        if (verb > qi::log::verbosity() || _private->_file == NULL)
+        if (_private->_file == NULL)
         {
           return;
         }
         else
         {
-          const char* head = logLevelToString(verb);
-          char fixedCategory[CATSIZEMAX + 1];
-          fixedCategory[CATSIZEMAX] = '\0';
-          _private->cutCat(category, fixedCategory);
-
-          std::stringstream ss;
-          ss << date.tv_sec << "." << date.tv_usec;
-
-          fprintf(_private->_file,"%s ", head);
-          int ctx = qi::log::context();
-          switch (ctx)
-          {
-          case 1:
-            fprintf(_private->_file, "%s: ", fixedCategory);
-            break;
-          case 2:
-            fprintf(_private->_file, "%s ", ss.str().c_str());
-            break;
-          case 3:
-            fprintf(_private->_file, "%s(%d) ", file, line);
-            break;
-          case 4:
-            fprintf(_private->_file, "%s %s: ", ss.str().c_str(), fixedCategory);
-            break;
-          case 5:
-            fprintf(_private->_file, "%s %s(%d) ", ss.str().c_str(), file, line);
-            break;
-          case 6:
-            fprintf(_private->_file, "%s: %s(%d) ", fixedCategory, file, line);
-            break;
-          case 7:
-            fprintf(_private->_file, "%s %s: %s(%d) %s ", ss.str().c_str(), fixedCategory, file, line, fct);
-            break;
-          default:
-            break;
-          }
-          fprintf(_private->_file,"%s", msg);
+          char *buffer = detail::lineBuffer();
+          unsigned int size = _private->_formatter.format(buffer, LINESIZEMAX,
+                                                          verb, date, category, msg,
+                                                          file, fct, line);
+          fwrite(buffer, 1, size, _private->_file);
           _private->_count++;
 
           fflush(_private->_file);
@@ -8,35 +8,281 @@
 #include <qi/os.hpp>
 #include <list>
 #include <map>
+#include <vector>
+#include <sstream>
+#include <algorithm>
 #include <cstring>
+#include <cctype>
 
 #include <qi/log/consoleloghandler.hpp>
+#include "logargs.hpp"
+#include "logclock.hpp"
+#include "loglimit.hpp"
+#include "logfields.hpp"
+#include "logcrash.hpp"
+#include "logoutput.hpp"
 
 #include <boost/thread/thread.hpp>
 #include <boost/thread/condition_variable.hpp>
+#include <boost/thread/tss.hpp>
+#include <boost/thread/thread_time.hpp>
+#include <boost/atomic.hpp>
 #include <boost/lockfree/fifo.hpp>
+#include <boost/lockfree/stack.hpp>
 #include <boost/function.hpp>
+#include <boost/bind.hpp>
 
-#define RTLOG_BUFFERS (128)
+// Default size in bytes of each producer thread ring.
+#define RTLOG_RING_SIZE (64 * 1024)
+// Largest record, longer messages are truncated.
+#define RTLOG_MAX_RECORD (16 * 1024)
+// Number of records shared by all threads with the spillToPool policy,
+// and their size.
+#define RTLOG_SPILL_BUFFERS (256)
+#define RTLOG_SPILL_SIZE (2048)
+// Maximum number of records handed to the handlers in one call.
+#define RTLOG_BATCH (64)
+// Bytes of records copied out of the rings per batch with dropOldest.
+#define RTLOG_COPY_SIZE (64 * 1024)
 
-#define CAT_SIZE 64
 #define FILE_SIZE 128
 #define FUNC_SIZE 64
 #define LOG_SIZE 2048
 
+#ifdef _WIN32
+# define LOG_NEWLINE "\r\n"
+#else
+# define LOG_NEWLINE "\n"
+#endif
+
+#define RECORD_ALIGN(size) (((size) + 7) & ~7u)
+#define RECORD_HEADER_SIZE RECORD_ALIGN(sizeof(qi::log::RecordHeader))
+
 namespace qi {
   namespace log {
 
-    typedef struct sPrivateLog
+    /*
+     * A record is a header followed by the deferred arguments and the typed
+     * fields, then the file and function, unless its call site has them,
+     * and the message,
+     * each '\0' terminated. Its size is a multiple of 8 so that the next
+     * header stays aligned.
+     */
+    struct RecordHeader
+    {
+      // bytes up to the next record
+      unsigned int     size;
+      // fills the end of a ring, the next record starts at its beginning
+      bool             padding;
+      LogLevel         level;
+      int              line;
+      boost::uint64_t  timestamp;
+      // request order across the rings; the synchronous records are not
+      // queued and have none, a flush does not wait for them
+      unsigned long    seq;
+      const detail::Category *category;
+      const detail::CallSite *site;
+      // bytes of the deferred printf format at the start of the arguments,
+      // 0 when the message is complete; it is the text streamed after it
+      unsigned int     fmtSize;
+      unsigned int     argsSize;
+      unsigned int     fieldsSize;
+      unsigned int     fileLen;
+      unsigned int     functionLen;
+      unsigned int     messageLen;
+    };
+
+    /*
+     * Single producer / single consumer byte ring owned by one logging thread.
+     *
+     * _head and _tail are byte positions that only grow, the buffer size is
+     * a power of two. The producer only writes _head and the bytes past it,
+     * the consumer (the thread holding LogDrainLock) only writes _tail. Bytes
+     * are never reused before the consumer moved _tail past them, so a record
+     * is either delivered whole or, when the ring is full, counted as
+     * dropped. A record never wraps: when it does not fit before the end of
+     * the buffer, the end is skipped, with a padding header if there is room.
+     */
+    class ProducerRing
+    {
+    public:
+      explicit ProducerRing(unsigned int size)
+        : _size(size)
+        , _buffer(new char[size])
+      {
+        _head.store(0);
+        _tail.store(0);
+        _orphaned.store(false);
+      }
+
+      ~ProducerRing()
+      {
+        delete[] _buffer;
+      }
+
+      RecordHeader *at(unsigned long pos)
+      {
+        return reinterpret_cast<RecordHeader*>(_buffer + (pos & (_size - 1)));
+      }
+
+      // bytes from pos to the end of the buffer
+      unsigned int contiguous(unsigned long pos) const
+      {
+        return _size - (pos & (_size - 1));
+      }
+
+      // Bytes taken by a record of size written at head, counting the
+      // end of the buffer skipped when it does not fit before it.
+      unsigned int need(unsigned long head, unsigned int size) const
+      {
+        unsigned int left = contiguous(head);
+        return size <= left ? size : left + size;
+      }
+
+      // Where a record of size written at head goes, skipping the end of
+      // the buffer if needed. The room was checked with need().
+      unsigned long place(unsigned long head, unsigned int size)
+      {
+        unsigned int left = contiguous(head);
+        if (size <= left)
+          return head;
+        if (left >= RECORD_HEADER_SIZE)
+        {
+          RecordHeader *padding = at(head);
+          padding->size = left;
+          padding->padding = true;
+        }
+        return head + left;
+      }
+
+      unsigned int maxRecord() const
+      {
+        return std::min(_size / 4, (unsigned int)RTLOG_MAX_RECORD);
+      }
+
+      // Position of the first record at or after pos, head if there is none.
+      unsigned long first(unsigned long pos, unsigned long head)
+      {
+        while ((long)(head - pos) > 0)
+        {
+          unsigned int left = contiguous(pos);
+          if (left < RECORD_HEADER_SIZE)
+          {
+            pos += left;
+            continue;
+          }
+          RecordHeader *h = at(pos);
+          if (!h->padding)
+            return pos;
+          pos += std::max(h->size, (unsigned int)RECORD_HEADER_SIZE);
+        }
+        return head;
+      }
+
+      const unsigned int            _size;
+      char                         *_buffer;
+      boost::atomic<unsigned long>  _head;
+      boost::atomic<unsigned long>  _tail;
+      // set when the owner thread exits, the consumer frees the ring once drained
+      boost::atomic<bool>           _orphaned;
+    };
+
+    // Ring sizes are powers of two, between 16 KB and 64 MB.
+    static unsigned int ringBytes(unsigned int bytes)
+    {
+      unsigned int size = 16 * 1024;
+      while (size < bytes && size < 64 * 1024 * 1024)
+        size *= 2;
+      return size;
+    }
+
+    // Histogram bucket of a duration in nanoseconds, see LogHistogramSize.
+    static unsigned int histogramBucket(boost::uint64_t ns)
+    {
+      boost::uint64_t us = ns / 1000;
+      unsigned int bucket = 0;
+      while (us && bucket < LogHistogramSize - 1)
+      {
+        us >>= 1;
+        ++bucket;
+      }
+      return bucket;
+    }
+
+    // Calls of a handler and their duration, shared by the copies of its
+    // Handler and by its SinkWorker.
+    struct HandlerCounters
+    {
+      HandlerCounters()
+      {
+        calls.store(0);
+        records.store(0);
+        for (int i = 0; i < LogHistogramSize; ++i)
+          time[i].store(0);
+      }
+
+      // a call handling count records, started at start
+      void count(unsigned int count, boost::uint64_t start)
+      {
+        boost::uint64_t end = detail::timestamp();
+        calls.fetch_add(1, boost::memory_order_relaxed);
+        records.fetch_add(count, boost::memory_order_relaxed);
+        time[histogramBucket(end > start ? end - start : 0)].fetch_add(1, boost::memory_order_relaxed);
+      }
+
+      boost::atomic<unsigned long>  calls;
+      boost::atomic<unsigned long>  records;
+      boost::atomic<unsigned long>  time[LogHistogramSize];
+    };
+
+    /*
+     * Queue and thread of a handler added with a queue size. The log thread
+     * copies the records in the queue, the worker thread formats them and
+     * calls the handler: a slow handler does not delay the others.
+     */
+    class SinkWorker
+    {
+    public:
+      SinkWorker(const logBatchFuncHandler &fct,
+                 unsigned int               size,
+                 HandlerCounters           *counters);
+      ~SinkWorker();
+
+      void push(const RecordHeader *const *records, unsigned int count);
+      void run();
+      bool flush(const boost::system_time *deadline);
+
+      boost::atomic<unsigned long>  queued;
+      boost::atomic<unsigned long>  dropped;
+      // records given to the handler, flush() waits on it
+      boost::atomic<unsigned long>  handled;
+
+    private:
+      logBatchFuncHandler           _fct;
+      HandlerCounters              *_counters;
+      ProducerRing                  _ring;
+      // several threads deliver synchronous logs
+      boost::mutex                  _pushLock;
+      boost::mutex                  _lock;
+      boost::condition_variable     _cond;
+      boost::condition_variable     _handledCond;
+      boost::atomic<int>            _flushWaiters;
+      bool                          _stop;
+      boost::thread                 _thread;
+    };
+
+    struct Handler
     {
-      LogLevel        _logLevel;
-      char            _category[CAT_SIZE];
-      char            _file[FILE_SIZE];
-      char            _function[FUNC_SIZE];
-      int             _line;
-      char            _log[LOG_SIZE];
-      qi::os::timeval _date;
-    } privateLog;
+      std::string          name;
+      logBatchFuncHandler  fct;
+      // writes what the handler buffers, called by flush() and destroy()
+      logFlushFuncHandler  flush;
+      // set for the handlers running on their own thread
+      SinkWorker          *worker;
+      HandlerCounters     *counters;
+    };
+
+    typedef std::vector<Handler> HandlerList;
 
     class Log
     {
@@ -45,189 +291,1549 @@ namespace qi {
       inline ~Log();
 
       void run();
+      bool pending();
+      void wake();
       void printLog();
+      bool barrier(const boost::system_time *deadline);
+      unsigned long undelivered();
+      bool flushWorkers(const boost::system_time *deadline);
+      void dispatch(const RecordHeader *record, char *text, LogField *fields);
+      void deliver(const LogRecord          *records,
+                   const RecordHeader *const *headers,
+                   unsigned int              count);
+      void setHandler(const std::string         &name,
+                      const logBatchFuncHandler *fct,
+                      unsigned int               queueSize);
+      void setHandlerFlush(const std::string         &name,
+                           const logFlushFuncHandler &fct);
+      void publishHandlers(HandlerList *list);
+      bool overflow(ProducerRing   *ring,
+                    unsigned long   head,
+                    unsigned int    need,
+                    const LogLevel  verb,
+                    RecordHeader  **spill);
 
     public:
       bool                       LogInit;
+      // set when destroy() timed out: the rings belong to the next instance
+      boost::atomic<bool>        abandoned;
       boost::thread              LogThread;
       boost::mutex               LogWriteLock;
-      boost::mutex               LogHandlerLock;
+      boost::mutex               LogDrainLock;
       boost::condition_variable  LogReadyCond;
+      // set while the log thread is parked on LogReadyCond
+      boost::atomic<bool>        sleeping;
+      // microseconds of polling before parking, and maximum park duration
+      unsigned int               spin;
+      unsigned int               maxLatency;
+
+      // overflow policy, fixed for the lifetime of the instance
+      LogOverflowPolicy          policy;
+      unsigned int               blockTimeout;
+      boost::mutex               LogSpaceLock;
+      boost::condition_variable  LogSpaceCond;
+      boost::atomic<int>         spaceWaiters;
+
+      // Records consumed since the instance started: delivered by the log
+      // thread or discarded by the dropOldest producers. A flush waits for
+      // it to reach the sequence numbers taken before the call.
+      unsigned long                 seqBase;
+      boost::atomic<unsigned long>  consumed;
+      boost::mutex                  LogFlushLock;
+      boost::condition_variable     LogFlushCond;
+      boost::atomic<int>            flushWaiters;
+
+      // size of the rings, the threads replace theirs when it changes
+      unsigned int               ringSize;
+
+      char                                   *spillRecords;
+      RecordHeader                           *pendingSpill;
+      boost::lockfree::stack<RecordHeader*>   spillPool;
+      boost::lockfree::fifo<RecordHeader*>    spilled;
+
+      // records drained by printLog and not delivered yet
+      LogRecord                  batch[RTLOG_BATCH];
+      LogField                   batchFields[RTLOG_BATCH][detail::LogFields::maxCount];
+      char                     (*batchText)[LOG_SIZE];
+      char                      *batchCopies;
+
+      // Handler registry. Readers never lock: they register in the reader
+      // count of the current epoch and use the published list. Writers
+      // publish a copy, flip the epoch and free the old list once the
+      // readers of the previous epoch are gone.
+      boost::mutex                 HandlerWriteLock;
+      boost::atomic<HandlerList*>  logHandlers;
+      boost::atomic<unsigned int>  handlerEpoch;
+      boost::atomic<int>           handlerReaders[2];
+    };
+
+    class HandlerReader
+    {
+    public:
+      explicit HandlerReader(Log *log)
+        : _log(log)
+      {
+        while (true)
+        {
+          _epoch = _log->handlerEpoch.load() & 1;
+          _log->handlerReaders[_epoch].fetch_add(1);
+          if ((_log->handlerEpoch.load() & 1) == _epoch)
+            break;
+          // a writer flipped the epoch in between, it may not wait for us
+          _log->handlerReaders[_epoch].fetch_sub(1);
+        }
+      }
+
+      ~HandlerReader()
+      {
+        _log->handlerReaders[_epoch].fetch_sub(1, boost::memory_order_release);
+      }
+
+      const HandlerList *handlers() const
+      {
+        return _log->logHandlers.load(boost::memory_order_acquire);
+      }
+
+    private:
+      Log          *_log;
+      unsigned int  _epoch;
+    };
+
+    static int                    _glContext = false;
+    static LogLevel               _glVerbosity = qi::log::info;
+    static bool                   _glSyncLog = false;
+    static bool                   _glDeferredFormatting = false;
+    static unsigned int           _glRingSize = RTLOG_RING_SIZE;
+    static bool                   _glInit    = false;
+    static bool                   _glAtExit  = false;
+    static LogOverflowPolicy      _glOverflowPolicy = qi::log::dropNewest;
+    static unsigned int           _glBlockTimeout = 100;
+    static unsigned int           _glMaxLatency = 100;
+    static unsigned int           _glSpin = 0;
+    static unsigned int           _glStatsInterval = 0;
+    static unsigned int           _glShutdownTimeout = 1000;
+    static ConsoleLogHandler      *_glConsoleLogHandler;
+
+    // published for the log calls, see CallerGuard
+    static boost::atomic<Log*>    LogInstance;
+
+    // Producer rings outlive Log instances: a thread keeps its ring across
+    // init()/destroy() cycles and only gives it back when it exits.
+    static void releaseRing(ProducerRing *ring)
+    {
+      ring->_orphaned.store(true, boost::memory_order_release);
+    }
+
+    static boost::mutex                           LogRingsLock;
+    static std::vector<ProducerRing*>             LogRings;
+    static boost::thread_specific_ptr<ProducerRing> LogLocalRing(&releaseRing);
+
+    // What a synchronous log delivers from, off the stack of the caller.
+    struct SyncScratch
+    {
+      union
+      {
+        RecordHeader header;
+        char         bytes[RTLOG_MAX_RECORD];
+      } record;
+      char     text[LOG_SIZE];
+      LogField fields[detail::LogFields::maxCount];
+      bool     busy;
+    };
+
+    static boost::thread_specific_ptr<SyncScratch> LogLocalScratch;
+    static boost::atomic<unsigned long>           LogSequence;
+    static boost::atomic<unsigned long>           LogDropped[debug + 1];
+    static boost::atomic<unsigned long>           LogLogged[debug + 1];
+    // records rejected once logging was shut down, or not delivered by
+    // destroy() in time
+    static boost::atomic<unsigned long>           LogLost;
+    // log calls in progress, destroy() waits for them before freeing the
+    // instance they use
+    static boost::atomic<int>                     LogCallers;
+    static boost::atomic<unsigned long>           LogLatency[LogHistogramSize];
+
+    namespace detail {
+      LogLevel                    maxVerbosity = qi::log::info;
+      bool                        deferredFormatting = false;
+    }
+
+    namespace detail {
+      struct CategoryStats
+      {
+        boost::atomic<unsigned long> logged;
+      };
+    }
+
+    typedef std::map<std::string, detail::Category*>       CategoryMap;
+    typedef std::vector<std::pair<std::string, LogLevel> > CategoryRules;
+
+    struct CategoryTable
+    {
+      CategoryTable()
+        : sites(0)
+      {
+      }
+
+      boost::mutex  lock;
+      CategoryMap   categories;
+      // glob pattern and level, the last matching rule wins
+      CategoryRules rules;
+      // every call site reached so far, linked by CallSite::next
+      detail::CallSite *sites;
+    };
+
+    // Lock-free index of the interned categories, for the logs without
+    // call site. Slots are only ever filled, and categories never freed:
+    // a reader sees a null slot or a complete category. Past three
+    // quarters full, the new categories are only found under the lock.
+#define CATEGORY_INDEX_SIZE 4096
+    static boost::atomic<detail::Category*> CategoryIndex[CATEGORY_INDEX_SIZE];
+    static unsigned int                     CategoryIndexCount;
+
+    static unsigned int categoryHash(const char *name)
+    {
+      // FNV-1a
+      unsigned int hash = 2166136261u;
+      for (; *name; ++name)
+        hash = (hash ^ (unsigned char)*name) * 16777619u;
+      return hash;
+    }
+
+    static detail::Category *findCategory(const char *name)
+    {
+      unsigned int hash = categoryHash(name);
+      for (unsigned int i = 0; i < CATEGORY_INDEX_SIZE; ++i)
+      {
+        detail::Category *c =
+          CategoryIndex[(hash + i) % CATEGORY_INDEX_SIZE].load(boost::memory_order_acquire);
+        if (!c)
+          return 0;
+        if (strcmp(c->name, name) == 0)
+          return c;
+      }
+      return 0;
+    }
+
+    // Must be called with the table lock held.
+    static void indexCategory(detail::Category *c)
+    {
+      if (CategoryIndexCount >= CATEGORY_INDEX_SIZE / 4 * 3)
+        return;
+      unsigned int hash = categoryHash(c->name);
+      for (unsigned int i = 0; i < CATEGORY_INDEX_SIZE; ++i)
+      {
+        boost::atomic<detail::Category*> &slot = CategoryIndex[(hash + i) % CATEGORY_INDEX_SIZE];
+        if (!slot.load(boost::memory_order_relaxed))
+        {
+          slot.store(c, boost::memory_order_release);
+          ++CategoryIndexCount;
+          return;
+        }
+      }
+    }
+
+    // Leaked on purpose: categories are still looked up by the static
+    // destructors of other modules, after this one is gone.
+    static CategoryTable &categoryTable()
+    {
+      static CategoryTable *table = new CategoryTable;
+      return *table;
+    }
+
+    static class DefaultLogInit
+    {
+    public:
+      DefaultLogInit()
+      {
+        _glInit = false;
+        qi::log::init();
+      }
+
+      ~DefaultLogInit()
+      {
+        qi::log::destroy();
+      };
+    } synchLog;
+
+    static void my_strcpy(char *dst, const char *src, int len);
+    static void endLine(char *buf, int len);
+    static void reportSuppressed(Log *log, bool force);
+    static void reportStats(Log *log);
+
+    // Fill a record pointing into h, text receives deferred messages and
+    // fields the decoded fields.
+    static void toRecord(const RecordHeader *h,
+                         char               *text,
+                         LogField           *fields,
+                         LogRecord          *record)
+    {
+      const char *args = reinterpret_cast<const char*>(h) + RECORD_HEADER_SIZE;
+      const char *file = args + h->argsSize + h->fieldsSize;
+      const char *function = file + h->fileLen + 1;
+      record->level = h->level;
+      record->timestamp = h->timestamp;
+      detail::wallClock(h->timestamp, &record->date);
+      record->category = h->category->name;
+      record->paddedCategory = h->category->padded;
+      record->file = h->site ? h->site->file : file;
+      record->function = h->site ? h->site->function : function;
+      record->message = function + h->functionLen + 1;
+      record->line = h->line;
+      record->fields = fields;
+      record->fieldCount = h->fieldsSize ?
+        detail::decodeFields(args + h->argsSize, h->fieldsSize, fields) : 0;
+      if (h->fmtSize)
+      {
+        int len = detail::formatArgs(args, args + h->fmtSize, h->argsSize - h->fmtSize,
+                                     text, LOG_SIZE);
+        my_strcpy(text + len, record->message, LOG_SIZE - len);
+        endLine(text, LOG_SIZE);
+        record->message = text;
+      }
+    }
+
+    SinkWorker::SinkWorker(const logBatchFuncHandler &fct,
+                           unsigned int               size,
+                           HandlerCounters           *counters)
+      : _fct(fct)
+      , _counters(counters)
+      , _ring(size)
+      , _stop(false)
+    {
+      queued.store(0);
+      dropped.store(0);
+      handled.store(0);
+      _flushWaiters.store(0);
+      _thread = boost::thread(&SinkWorker::run, this);
+    }
+
+    // Deliver what is queued, then stop.
+    SinkWorker::~SinkWorker()
+    {
+      {
+        boost::mutex::scoped_lock l(_lock);
+        _stop = true;
+        _cond.notify_one();
+      }
+      _thread.join();
+    }
+
+    void SinkWorker::push(const RecordHeader *const *records, unsigned int count)
+    {
+      boost::mutex::scoped_lock l(_pushLock);
+      unsigned long head = _ring._head.load(boost::memory_order_relaxed);
+      unsigned long tail = _ring._tail.load(boost::memory_order_acquire);
+      unsigned int pushed = 0;
+      for (unsigned int i = 0; i < count; ++i)
+      {
+        unsigned int size = records[i]->size;
+        if (head + _ring.need(head, size) - tail > _ring._size)
+        {
+          dropped.fetch_add(1, boost::memory_order_relaxed);
+          continue;
+        }
+        head = _ring.place(head, size);
+        memcpy(_ring.at(head), records[i], size);
+        head += size;
+        ++pushed;
+      }
+      if (!pushed)
+        return;
+      _ring._head.store(head, boost::memory_order_release);
+      queued.fetch_add(pushed, boost::memory_order_relaxed);
+
+      boost::mutex::scoped_lock w(_lock);
+      _cond.notify_one();
+    }
+
+    void SinkWorker::run()
+    {
+      LogRecord batch[RTLOG_BATCH];
+      LogField  fields[RTLOG_BATCH][detail::LogFields::maxCount];
+      char (*text)[LOG_SIZE] = new char[RTLOG_BATCH][LOG_SIZE];
+      while (true)
+      {
+        unsigned long head = _ring._head.load(boost::memory_order_acquire);
+        unsigned long tail = _ring._tail.load(boost::memory_order_relaxed);
+        unsigned int count = 0;
+        while (count < RTLOG_BATCH)
+        {
+          tail = _ring.first(tail, head);
+          if (tail == head)
+            break;
+          RecordHeader *h = _ring.at(tail);
+          toRecord(h, text[count], fields[count], &batch[count]);
+          ++count;
+          tail += h->size;
+        }
+        if (count)
+        {
+          boost::uint64_t start = detail::timestamp();
+          _fct(batch, count);
+          _counters->count(count, start);
+        }
+        _ring._tail.store(tail, boost::memory_order_release);
+        if (count)
+        {
+          handled.fetch_add(count, boost::memory_order_release);
+          boost::atomic_thread_fence(boost::memory_order_seq_cst);
+          if (_flushWaiters.load(boost::memory_order_relaxed) > 0)
+          {
+            boost::mutex::scoped_lock l(_lock);
+            _handledCond.notify_all();
+          }
+          continue;
+        }
+
+        // push notifies under _lock once the head is published
+        boost::mutex::scoped_lock l(_lock);
+        if (_ring._head.load(boost::memory_order_acquire) != tail)
+          continue;
+        if (_stop)
+          break;
+        _cond.wait(l);
+      }
+      delete[] text;
+    }
+
+    // Wait until the records queued before the call were handled, at most
+    // until deadline if set.
+    bool SinkWorker::flush(const boost::system_time *deadline)
+    {
+      // the handler would wait for itself
+      if (boost::this_thread::get_id() == _thread.get_id())
+        return true;
+      unsigned long target = queued.load(boost::memory_order_acquire);
+      bool done = true;
+      _flushWaiters.fetch_add(1);
+      {
+        boost::mutex::scoped_lock l(_lock);
+        while (!(done = (long)(handled.load(boost::memory_order_acquire) - target) >= 0))
+        {
+          if (!deadline)
+            _handledCond.wait(l);
+          else if (!_handledCond.timed_wait(l, *deadline))
+            break;
+        }
+      }
+      _flushWaiters.fetch_sub(1);
+      return done || (long)(handled.load(boost::memory_order_acquire) - target) >= 0;
+    }
+
+    void Log::deliver(const LogRecord          *records,
+                      const RecordHeader *const *headers,
+                      unsigned int              count)
+    {
+      if (!count)
+        return;
+      HandlerReader reader(this);
+      const HandlerList *list = reader.handlers();
+      HandlerList::const_iterator it;
+      for (it = list->begin(); it != list->end(); ++it)
+      {
+        if (it->worker)
+        {
+          it->worker->push(headers, count);
+          continue;
+        }
+        boost::uint64_t start = detail::timestamp();
+        it->fct(records, count);
+        it->counters->count(count, start);
+      }
+
+      // the handlers with a queue get the records later, not counted
+      boost::uint64_t now = detail::timestamp();
+      for (unsigned int i = 0; i < count; ++i)
+      {
+        boost::uint64_t ts = records[i].timestamp;
+        LogLatency[histogramBucket(now > ts ? now - ts : 0)].fetch_add(1, boost::memory_order_relaxed);
+      }
+    }
+
+    // Add, replace (fct) or remove (!fct) a handler. When it returns, no
+    // delivery uses the previous handler anymore, and the records queued
+    // for its thread, if any, were handled. Handlers must not call it.
+    void Log::setHandler(const std::string         &name,
+                         const logBatchFuncHandler *fct,
+                         unsigned int               queueSize)
+    {
+      boost::mutex::scoped_lock l(HandlerWriteLock);
+      HandlerList *old = logHandlers.load(boost::memory_order_relaxed);
+      HandlerList *list = new HandlerList;
+      list->reserve(old->size() + 1);
+
+      Handler handler;
+      handler.name = name;
+      handler.worker = 0;
+      handler.counters = 0;
+      if (fct)
+      {
+        handler.fct = *fct;
+        handler.counters = new HandlerCounters;
+        if (queueSize)
+          handler.worker = new SinkWorker(*fct, ringBytes(queueSize), handler.counters);
+      }
+
+      Handler previous;
+      previous.worker = 0;
+      previous.counters = 0;
+      bool added = !fct;
+      HandlerList::const_iterator it;
+      for (it = old->begin(); it != old->end(); ++it)
+      {
+        if (!added && name <= it->name)
+        {
+          list->push_back(handler);
+          added = true;
+        }
+        if (it->name != name)
+          list->push_back(*it);
+        else
+          previous = *it;
+      }
+      if (!added)
+        list->push_back(handler);
+
+      publishHandlers(list);
+      delete previous.worker;
+      delete previous.counters;
+    }
+
+    // Must be called with HandlerWriteLock held. When it returns, no
+    // delivery uses the previous list anymore.
+    void Log::publishHandlers(HandlerList *list)
+    {
+      HandlerList *old = logHandlers.load(boost::memory_order_relaxed);
+      logHandlers.store(list);
+      unsigned int epoch = handlerEpoch.fetch_add(1) & 1;
+      while (handlerReaders[epoch].load() != 0)
+        boost::this_thread::yield();
+      delete old;
+    }
+
+    // The flush function goes with the handler: replacing or removing the
+    // handler drops it.
+    void Log::setHandlerFlush(const std::string         &name,
+                              const logFlushFuncHandler &fct)
+    {
+      boost::mutex::scoped_lock l(HandlerWriteLock);
+      HandlerList *list = new HandlerList(*logHandlers.load(boost::memory_order_relaxed));
+      HandlerList::iterator it;
+      for (it = list->begin(); it != list->end(); ++it)
+      {
+        if (it->name == name)
+          it->flush = fct;
+      }
+      publishHandlers(list);
+    }
+
+    // Synchronous logs: deliver a single record from the caller thread.
+    void Log::dispatch(const RecordHeader *h, char *text, LogField *fields)
+    {
+      LogRecord record;
+      toRecord(h, text, fields, &record);
+      deliver(&record, &h, 1);
+    }
+
+    void Log::printLog()
+    {
+      boost::mutex::scoped_lock lock(LogDrainLock);
+      std::vector<ProducerRing*> rings;
+      {
+        boost::mutex::scoped_lock l(LogRingsLock);
+        rings = LogRings;
+      }
+
+      // Merge the rings and the spilled records on the global sequence
+      // number so that records are still displayed in their request order.
+      // Ring bytes are only given back to the producers once their batch
+      // was delivered, tails holds the consumer position of each ring
+      // meanwhile. With dropOldest the producers move the tails too: the
+      // records are copied out and the tails moved right away.
+      std::vector<unsigned long> tails(rings.size());
+      for (unsigned int i = 0; i < rings.size(); ++i)
+        tails[i] = rings[i]->_tail.load(boost::memory_order_relaxed);
+      const RecordHeader *headers[RTLOG_BATCH];
+      RecordHeader  *spills[RTLOG_BATCH];
+      unsigned int   spillCount = 0;
+      unsigned int   count = 0;
+      unsigned int   copied = 0;
+      while (true)
+      {
+        if (!pendingSpill)
+          spilled.dequeue(&pendingSpill);
+
+        bool           drained = false;
+        int            next = -1;
+        unsigned long  nextTail = 0;
+        unsigned long  nextPos = 0;
+        unsigned long  nextSeq = 0;
+        for (unsigned int i = 0; i < rings.size(); ++i)
+        {
+          ProducerRing *ring = rings[i];
+          unsigned long head = ring->_head.load(boost::memory_order_acquire);
+          unsigned long tail = policy == dropOldest ?
+            ring->_tail.load(boost::memory_order_acquire) : tails[i];
+          unsigned long pos = ring->first(tail, head);
+          if (pos == head)
+          {
+            // only padding left, give it back
+            if (policy == dropOldest)
+              ring->_tail.compare_exchange_strong(tail, pos, boost::memory_order_acq_rel);
+            else
+              tails[i] = pos;
+            continue;
+          }
+          unsigned long seq = ring->at(pos)->seq;
+          if (next < 0 || (long)(seq - nextSeq) < 0)
+          {
+            next = i;
+            nextTail = tail;
+            nextPos = pos;
+            nextSeq = seq;
+          }
+        }
+
+        if (pendingSpill && (next < 0 || (long)(pendingSpill->seq - nextSeq) < 0))
+        {
+          toRecord(pendingSpill, batchText[count], batchFields[count], &batch[count]);
+          headers[count] = pendingSpill;
+          ++count;
+          spills[spillCount++] = pendingSpill;
+          pendingSpill = 0;
+        }
+        else if (next >= 0)
+        {
+          ProducerRing *ring = rings[next];
+          RecordHeader *h = ring->at(nextPos);
+          if ((long)(h->seq - seqBase) < 0)
+          {
+            // left by an abandoned instance, which counted it as lost: it
+            // must not count as consumed by this one
+            if (policy == dropOldest)
+              ring->_tail.compare_exchange_strong(nextTail,
+                                                  nextPos + std::min(h->size, ring->contiguous(nextPos)),
+                                                  boost::memory_order_acq_rel);
+            else
+              tails[next] = nextPos + h->size;
+          }
+          else if (policy == dropOldest)
+          {
+            // The producer may discard this record while we read it: deliver
+            // a copy, and only if the tail did not move in the meantime.
+            unsigned int size = std::min(h->size, ring->contiguous(nextPos));
+            size = std::min(size, (unsigned int)RTLOG_MAX_RECORD);
+            memcpy(batchCopies + copied, h, size);
+            if (ring->_tail.compare_exchange_strong(nextTail, nextPos + size,
+                                                    boost::memory_order_acq_rel))
+            {
+              headers[count] = reinterpret_cast<RecordHeader*>(batchCopies + copied);
+              toRecord(headers[count], batchText[count], batchFields[count], &batch[count]);
+              ++count;
+              copied += RECORD_ALIGN(size);
+            }
+          }
+          else
+          {
+            toRecord(h, batchText[count], batchFields[count], &batch[count]);
+            headers[count] = h;
+            ++count;
+            tails[next] = nextPos + h->size;
+          }
+        }
+        else
+        {
+          drained = true;
+        }
+
+        if (count == RTLOG_BATCH || copied + RTLOG_MAX_RECORD > RTLOG_COPY_SIZE || drained)
+        {
+          deliver(batch, headers, count);
+          // the next instance owns the rings now, leave them alone
+          if (abandoned.load(boost::memory_order_acquire))
+            break;
+          consumed.fetch_add(count, boost::memory_order_release);
+          count = 0;
+          copied = 0;
+          if (policy != dropOldest)
+          {
+            for (unsigned int i = 0; i < rings.size(); ++i)
+              rings[i]->_tail.store(tails[i], boost::memory_order_release);
+          }
+          for (unsigned int i = 0; i < spillCount; ++i)
+            spillPool.push(spills[i]);
+          spillCount = 0;
+          if (drained)
+            break;
+        }
+      }
+
+      // wake up the producers blocked on a full ring, and the flushes
+      boost::atomic_thread_fence(boost::memory_order_seq_cst);
+      if (spaceWaiters.load(boost::memory_order_relaxed) > 0)
+      {
+        boost::mutex::scoped_lock l(LogSpaceLock);
+        LogSpaceCond.notify_all();
+      }
+      if (flushWaiters.load(boost::memory_order_relaxed) > 0)
+      {
+        boost::mutex::scoped_lock l(LogFlushLock);
+        LogFlushCond.notify_all();
+      }
+
+      // Free the rings of the threads that exited, once they are drained.
+      if (abandoned.load(boost::memory_order_acquire))
+        return;
+      boost::mutex::scoped_lock l(LogRingsLock);
+      std::vector<ProducerRing*>::iterator it = LogRings.begin();
+      while (it != LogRings.end())
+      {
+        ProducerRing *ring = *it;
+        if (ring->_orphaned.load(boost::memory_order_acquire) &&
+            ring->_tail.load(boost::memory_order_relaxed) ==
+            ring->_head.load(boost::memory_order_acquire))
+        {
+          it = LogRings.erase(it);
+          delete ring;
+        }
+        else
+        {
+          ++it;
+        }
+      }
+    }
+
+    // Wait until the log thread delivered every record which got its
+    // sequence number before the call, including the ones still being
+    // written. At most until deadline if set.
+    bool Log::barrier(const boost::system_time *deadline)
+    {
+      // the log thread would wait for itself
+      if (boost::this_thread::get_id() == LogThread.get_id())
+        return false;
+      unsigned long target = LogSequence.load() - seqBase;
+      bool done = true;
+      flushWaiters.fetch_add(1);
+      wake();
+      {
+        boost::mutex::scoped_lock l(LogFlushLock);
+        while (!(done = (long)(consumed.load(boost::memory_order_acquire) - target) >= 0))
+        {
+          if (!deadline)
+            LogFlushCond.wait(l);
+          else if (!LogFlushCond.timed_wait(l, *deadline))
+            break;
+        }
+      }
+      flushWaiters.fetch_sub(1);
+      return done || (long)(consumed.load(boost::memory_order_acquire) - target) >= 0;
+    }
+
+    // Records published to this instance and not handled yet, by the log
+    // thread or by the handler threads.
+    unsigned long Log::undelivered()
+    {
+      unsigned long count = 0;
+      if (LogThread.joinable())
+      {
+        unsigned long published = LogSequence.load() - seqBase;
+        unsigned long done = consumed.load(boost::memory_order_acquire);
+        if ((long)(published - done) > 0)
+          count += published - done;
+      }
+      HandlerReader reader(this);
+      const HandlerList *list = reader.handlers();
+      HandlerList::const_iterator it;
+      for (it = list->begin(); it != list->end(); ++it)
+      {
+        if (it->worker)
+          count += it->worker->queued.load(boost::memory_order_relaxed)
+            - it->worker->handled.load(boost::memory_order_relaxed);
+      }
+      return count;
+    }
+
+    // Wait until the handler threads handled what was queued for them.
+    bool Log::flushWorkers(const boost::system_time *deadline)
+    {
+      bool done = true;
+      HandlerReader reader(this);
+      const HandlerList *list = reader.handlers();
+      HandlerList::const_iterator it;
+      for (it = list->begin(); it != list->end(); ++it)
+      {
+        if (it->worker && !it->worker->flush(deadline))
+        {
+          // its thread may still be writing, leave its buffers alone
+          done = false;
+          continue;
+        }
+        if (it->flush)
+          it->flush();
+      }
+      return done;
+    }
+
+    // Whether a record waits in a ring or in the spill queue.
+    bool Log::pending()
+    {
+      if (pendingSpill || !spilled.empty())
+        return true;
+      boost::mutex::scoped_lock l(LogRingsLock);
+      for (unsigned int i = 0; i < LogRings.size(); ++i)
+      {
+        ProducerRing *ring = LogRings[i];
+        if (ring->_head.load(boost::memory_order_acquire) !=
+            ring->_tail.load(boost::memory_order_relaxed))
+          return true;
+      }
+      return false;
+    }
+
+    // Called by the producers once their record is published. Only the
+    // first one to find the log thread parked pays for the notification.
+    void Log::wake()
+    {
+      boost::atomic_thread_fence(boost::memory_order_seq_cst);
+      if (!sleeping.load(boost::memory_order_relaxed))
+        return;
+      bool parked = true;
+      if (sleeping.compare_exchange_strong(parked, false))
+      {
+        boost::mutex::scoped_lock lock(LogWriteLock);
+        LogReadyCond.notify_one();
+      }
+    }
+
+    void Log::run()
+    {
+      boost::uint64_t lastStats = detail::timestamp();
+      while (LogInit)
+      {
+        reportSuppressed(this, false);
+        unsigned int statsInterval = _glStatsInterval;
+        if (statsInterval && detail::timestamp() - lastStats >= statsInterval * 1000000ULL)
+        {
+          lastStats = detail::timestamp();
+          reportStats(this);
+        }
+        printLog();
+
+        // the next record often follows closely, poll a while
+        if (spin)
+        {
+          boost::uint64_t deadline = detail::timestamp() + spin * 1000ULL;
+          while (LogInit && !pending() && detail::timestamp() < deadline)
+            boost::this_thread::yield();
+        }
+
+        // Park. A producer publishes its record then reads sleeping, we
+        // set sleeping then look for records: one of us sees the other.
+        boost::mutex::scoped_lock lock(LogWriteLock);
+        sleeping.store(true);
+        if (LogInit && !pending())
+          LogReadyCond.timed_wait(lock, boost::posix_time::milliseconds(maxLatency));
+        sleeping.store(false);
+      }
+    };
+
+    inline Log::Log()
+      : spin(_glSpin)
+      , maxLatency(_glMaxLatency)
+      , policy(_glOverflowPolicy)
+      , blockTimeout(_glBlockTimeout)
+      , ringSize(_glRingSize)
+      , spillRecords(0)
+      , pendingSpill(0)
+      , batchCopies(0)
+    {
+      sleeping.store(false);
+      spaceWaiters.store(0);
+      seqBase = LogSequence.load();
+      consumed.store(0);
+      flushWaiters.store(0);
+      logHandlers.store(new HandlerList);
+      handlerEpoch.store(0);
+      handlerReaders[0].store(0);
+      handlerReaders[1].store(0);
+      batchText = new char[RTLOG_BATCH][LOG_SIZE];
+      if (policy == dropOldest)
+        batchCopies = new char[RTLOG_COPY_SIZE];
+      if (policy == spillToPool)
+      {
+        spillRecords = new char[RTLOG_SPILL_BUFFERS * RTLOG_SPILL_SIZE];
+        spillPool.reserve(RTLOG_SPILL_BUFFERS);
+        spilled.reserve(RTLOG_SPILL_BUFFERS);
+        for (int i = 0; i < RTLOG_SPILL_BUFFERS; ++i)
+          spillPool.push(reinterpret_cast<RecordHeader*>(spillRecords + i * RTLOG_SPILL_SIZE));
+      }
+
+      LogInit = true;
+      abandoned.store(false);
+      if (!_glSyncLog)
+        LogThread = boost::thread(&Log::run, this);
+    };
+
+    inline Log::~Log()
+    {
+      if (!LogInit)
+        return;
+
+      LogInit = false;
+
+      // init() sets the mode of the next instance before destroying this one
+      if (LogThread.joinable())
+      {
+        LogThread.interrupt();
+        LogThread.join();
+
+        printLog();
+      }
+      delete[] spillRecords;
+      delete[] batchCopies;
+      delete[] batchText;
+      // the handler threads deliver what they still have queued
+      HandlerList *list = logHandlers.load();
+      for (unsigned int i = 0; i < list->size(); ++i)
+      {
+        delete (*list)[i].worker;
+        delete (*list)[i].counters;
+      }
+      delete list;
+    }
+
+    static void countDropped(const LogLevel verb)
+    {
+      LogDropped[verb].fetch_add(1, boost::memory_order_relaxed);
+    }
+
+    static void countLogged(const LogLevel verb, const detail::Category *category)
+    {
+      LogLogged[verb].fetch_add(1, boost::memory_order_relaxed);
+      category->stats->logged.fetch_add(1, boost::memory_order_relaxed);
+    }
+
+    // Whether the record of need bytes can be written, in the ring or in
+    // *spill when it is set.
+    bool Log::overflow(ProducerRing   *ring,
+                       unsigned long   head,
+                       unsigned int    need,
+                       const LogLevel  verb,
+                       RecordHeader  **spill)
+    {
+      *spill = 0;
+      switch (policy)
+      {
+      case dropOldest:
+        {
+          unsigned long tail = ring->_tail.load(boost::memory_order_acquire);
+          while (head + need - tail > ring->_size)
+          {
+            // we wrote these records ourself, reading them is safe
+            unsigned long pos = ring->first(tail, head);
+            LogLevel oldest = ring->at(pos)->level;
+            unsigned long end = pos == head ? head : pos + ring->at(pos)->size;
+            if (ring->_tail.compare_exchange_strong(tail, end,
+                                                    boost::memory_order_acq_rel))
+            {
+              if (pos != head)
+              {
+                countDropped(oldest);
+                consumed.fetch_add(1, boost::memory_order_release);
+              }
+              tail = end;
+            }
+            // otherwise the consumer just freed some room, tail is reloaded
+          }
+          return true;
+        }
+
+      case blockWithTimeout:
+        {
+          // the log thread would wait for itself
+          if (boost::this_thread::get_id() == LogThread.get_id())
+            break;
+
+          boost::system_time deadline = boost::get_system_time()
+            + boost::posix_time::milliseconds(blockTimeout);
+          bool full = true;
+          spaceWaiters.fetch_add(1);
+          wake();
+          {
+            boost::mutex::scoped_lock l(LogSpaceLock);
+            while ((full = head + need - ring->_tail.load(boost::memory_order_acquire) > ring->_size))
+            {
+              if (!LogSpaceCond.timed_wait(l, deadline))
+                break;
+            }
+          }
+          spaceWaiters.fetch_sub(1);
+          if (!full)
+            return true;
+          break;
+        }
+
+      case spillToPool:
+        {
+          if (spillPool.pop(spill))
+            return true;
+          break;
+        }
+
+      case dropNewest:
+      default:
+        break;
+      }
+
+      countDropped(verb);
+      return false;
+    }
+
+    static void my_strcpy(char *dst, const char *src, int len) {
+      if (!src)
+        src = "(null)";
+     #ifdef _MSV_VER
+      strncpy_s(dst, len, src, _TRUNCATE);
+     #else
+      strncpy(dst, src, len);
+      dst[len - 1] = 0;
+     #endif
+    }
+
+    // The text in buf ends with a newline, truncated if needed.
+    static void endLine(char *buf, int len)
+    {
+      int size = strlen(buf);
+      if (size > 0 && buf[size - 1] == '\n')
+        return;
+      size = std::min(size, len - (int)sizeof(LOG_NEWLINE));
+      memcpy(buf + size, LOG_NEWLINE, sizeof(LOG_NEWLINE));
+    }
+
+    void init(qi::log::LogLevel verb,
+              int ctx,
+              bool synchronous,
+              qi::log::LogOverflowPolicy policy,
+              unsigned int blockTimeout)
+    {
+      setVerbosity(verb);
+      setContext(ctx);
+      setSynchronousLog(synchronous);
+      setOverflowPolicy(policy, blockTimeout);
+
+      if (_glInit)
+        destroy();
+
+      _glConsoleLogHandler = new ConsoleLogHandler;
+      LogInstance.store(new Log);
+      addLogBatchHandler("consoleloghandler",
+                         boost::bind(&ConsoleLogHandler::logBatch,
+                                     _glConsoleLogHandler,
+                                     _1, _2));
+      setLogHandlerFlush("consoleloghandler",
+                         boost::bind(&ConsoleLogHandler::flush, _glConsoleLogHandler));
+      _glInit = true;
+    }
+
+    /*
+     * Stop accepting records, wait for the log calls in progress, deliver
+     * what is left and let the handler threads handle their queue, then
+     * free the handlers. The whole is bounded by the shutdown timeout:
+     * past it, what is left is counted as lost and the instance is
+     * abandoned to the threads still using it.
+     */
+    void destroy()
+    {
+      if (!_glInit)
+        return;
+      Log *log = LogInstance.load();
+      reportSuppressed(log, true);
+      _glInit = false;
+      boost::system_time deadline = boost::get_system_time()
+        + boost::posix_time::milliseconds(_glShutdownTimeout);
+
+      // The callers registered after this see no instance, the others are
+      // waited for.
+      LogInstance.store(0);
+      bool idle;
+      while (!(idle = LogCallers.load() == 0) &&
+             boost::get_system_time() < deadline)
+        boost::this_thread::yield();
+
+      // the mode of the instance, init() already set the next one
+      bool threaded = log->LogThread.joinable();
+      bool drained = (!threaded || log->barrier(&deadline)) && log->flushWorkers(&deadline);
+      if (!drained || !idle)
+      {
+        unsigned long lost = log->undelivered();
+        LogLost.fetch_add(lost, boost::memory_order_relaxed);
+        fprintf(stderr, "qi.log: shutdown timed out, %lu records lost\n", lost);
+        // a log call or a handler may still use them, the log thread
+        // stops once its handlers return
+        log->abandoned.store(true);
+        log->LogInit = false;
+        _glConsoleLogHandler = 0;
+        return;
+      }
+
+      delete log;
+      // the handlers are gone with the instance
+      delete _glConsoleLogHandler;
+      _glConsoleLogHandler = 0;
+    }
+
+    static bool flushUntil(const boost::system_time *deadline)
+    {
+      if (!_glInit)
+        return true;
+      Log *log = LogInstance.load();
+      reportSuppressed(log, true);
+      // synchronous logs were delivered by their caller
+      if (log->LogThread.joinable() && !log->barrier(deadline))
+        return false;
+      return log->flushWorkers(deadline);
+    }
+
+    void flush()
+    {
+      flushUntil(0);
+    }
 
-      boost::lockfree::fifo<privateLog*>     logs;
-      std::map<std::string, logFuncHandler > logHandlers;
+    bool flush(unsigned int timeout)
+    {
+      boost::system_time deadline = boost::get_system_time()
+        + boost::posix_time::milliseconds(timeout);
+      return flushUntil(&deadline);
+    }
+
+    // What a record is made of, with the lengths of its strings.
+    struct RecordSource
+    {
+      LogLevel                verb;
+      const detail::Category *category;
+      const detail::CallSite *site;
+      const char             *msg;
+      const char             *file;
+      const char             *fct;
+      int                     line;
+      boost::uint64_t         timestamp;
+      const detail::LogArgs  *args;
+      const detail::LogFields *fields;
+      unsigned int            fileLen;
+      unsigned int           functionLen;
+      unsigned int           messageLen;
     };
 
-    static LogLevel               _glVerbosity = qi::log::info;
-    static int                    _glContext = false;
-    static bool                   _glSyncLog = false;
-    static bool                   _glInit    = false;
-    static bool                   _glAtExit  = false;
-    static ConsoleLogHandler      *_glConsoleLogHandler;
+    // Without a call site, the file and function names are copied.
+    static void prepareRecord(RecordSource           *src,
+                              const LogLevel          verb,
+                              const detail::Category *category,
+                              const detail::CallSite *site,
+                              const char             *msg,
+                              const char             *file,
+                              const char             *fct,
+                              const int               line,
+                              const detail::LogArgs  *args,
+                              const detail::LogFields *fields)
+    {
+      src->verb = verb;
+      src->category = category;
+      src->site = site;
+      src->msg = msg ? msg : "(null)";
+      src->file = file ? file : "(null)";
+      src->fct = fct ? fct : "(null)";
+      src->line = line;
+      src->timestamp = detail::timestamp();
+      src->args = args;
+      src->fields = fields;
+      src->fileLen = site ? 0 : detail::boundedLength(src->file, FILE_SIZE - 1);
+      src->functionLen = site ? 0 : detail::boundedLength(src->fct, FUNC_SIZE - 1);
+      src->messageLen = detail::boundedLength(src->msg, RTLOG_MAX_RECORD);
+    }
 
-    static Log                    *LogInstance;
-    static privateLog             LogBuffer[RTLOG_BUFFERS];
-    static volatile unsigned long LogPush = 0;
+    // Bytes taken by the record, at most capacity: the message is
+    // truncated to fit.
+    static unsigned int recordSize(const RecordSource &src, unsigned int capacity)
+    {
+      unsigned int size = RECORD_HEADER_SIZE
+        + (src.args ? src.args->size : 0)
+        + (src.fields ? src.fields->size : 0)
+        + src.fileLen + 1
+        + src.functionLen + 1
+        + src.messageLen + sizeof(LOG_NEWLINE);
+      return std::min((unsigned int)RECORD_ALIGN(size), capacity);
+    }
 
-    static class DefaultLogInit
+    static char *copyField(char *dst, const char *src, unsigned int len)
     {
-    public:
-      DefaultLogInit()
+      memcpy(dst, src, len);
+      dst[len] = '\0';
+      return dst + len + 1;
+    }
+
+    // Write the record in the size bytes at dst, but its sequence number.
+    static void writeRecord(char *dst, unsigned int size, const RecordSource &src)
+    {
+      RecordHeader *h = reinterpret_cast<RecordHeader*>(dst);
+      h->size = size;
+      h->padding = false;
+      h->level = src.verb;
+      h->line = src.line;
+      h->timestamp = src.timestamp;
+      h->fmtSize = src.args ? src.args->fmtSize : 0;
+      h->argsSize = src.args ? src.args->size : 0;
+      h->fieldsSize = src.fields ? src.fields->size : 0;
+      h->category = src.category;
+      h->site = src.site;
+      h->fileLen = src.fileLen;
+      h->functionLen = src.functionLen;
+
+      char *p = dst + RECORD_HEADER_SIZE;
+      if (src.args)
+        memcpy(p, src.args->data, src.args->size);
+      p += h->argsSize;
+      if (src.fields)
+        memcpy(p, src.fields->data, src.fields->size);
+      p += h->fieldsSize;
+      p = copyField(p, src.file, src.fileLen);
+      p = copyField(p, src.fct, src.functionLen);
+
+      // The message gets what is left. It ends with a newline, but for the
+      // deferred ones which get theirs once formatted.
+      const char *newline = src.args ? "" : LOG_NEWLINE;
+      unsigned int newlineLen = strlen(newline);
+      unsigned int room = (unsigned int)(dst + size - p) - 1 - newlineLen;
+      unsigned int len = std::min(src.messageLen, room);
+      memcpy(p, src.msg, len);
+      if (newlineLen && (len == 0 || p[len - 1] != '\n'))
       {
-        _glInit = false;
-        qi::log::init();
+        memcpy(p + len, newline, newlineLen);
+        len += newlineLen;
       }
+      p[len] = '\0';
+      h->messageLen = len;
+    }
 
-      ~DefaultLogInit()
+    static ProducerRing *localRing(unsigned int size)
+    {
+      ProducerRing *ring = LogLocalRing.get();
+      if (!ring || ring->_size != size)
       {
-        qi::log::destroy();
-      };
-    } synchLog;
+        // the previous ring, if any, is released and freed once drained
+        ring = new ProducerRing(size);
+        LogLocalRing.reset(ring);
+        boost::mutex::scoped_lock l(LogRingsLock);
+        LogRings.push_back(ring);
+      }
+      return ring;
+    }
 
-    void Log::printLog()
+    // '*' matches any sequence of characters, including dots.
+    static bool globMatch(const char *pattern, const char *name)
     {
-      privateLog* pl;
-      boost::mutex::scoped_lock lock(LogHandlerLock);
-      while (logs.dequeue(&pl))
+      while (*pattern)
       {
-        if (!logHandlers.empty())
+        if (*pattern == '*')
         {
-          std::map<std::string, logFuncHandler >::iterator it;
-          for (it = logHandlers.begin();
-               it != logHandlers.end(); ++it)
+          while (*pattern == '*')
+            ++pattern;
+          if (!*pattern)
+            return true;
+          for (; *name; ++name)
           {
-            (*it).second(pl->_logLevel,
-                         pl->_date,
-                         pl->_category,
-                         pl->_log,
-                         pl->_file,
-                         pl->_function,
-                         pl->_line);
+            if (globMatch(pattern, name))
+              return true;
           }
+          return false;
         }
+        if (*pattern != *name)
+          return false;
+        ++pattern;
+        ++name;
       }
+      return *name == '\0';
     }
 
-    void Log::run()
+    // Must be called with the table lock held.
+    static LogLevel categoryLevel(const CategoryTable &table, const char *name)
     {
-      while (LogInit)
+      LogLevel level = _glVerbosity;
+      CategoryRules::const_iterator it;
+      for (it = table.rules.begin(); it != table.rules.end(); ++it)
       {
-        {
-          boost::mutex::scoped_lock lock(LogWriteLock);
-          LogReadyCond.wait(lock);
-        }
-
-        printLog();
+        if (globMatch(it->first.c_str(), name))
+          level = it->second;
       }
-    };
+      return level;
+    }
 
-    inline Log::Log()
+    // Must be called with the table lock held.
+    static void updateCategories(CategoryTable &table)
     {
-      LogInit = true;
-      if (!_glSyncLog)
-        LogThread = boost::thread(&Log::run, this);
-    };
+      LogLevel maxLevel = _glVerbosity;
+      CategoryRules::const_iterator rit;
+      for (rit = table.rules.begin(); rit != table.rules.end(); ++rit)
+        maxLevel = std::max(maxLevel, rit->second);
 
-    inline Log::~Log()
+      CategoryMap::iterator it;
+      for (it = table.categories.begin(); it != table.categories.end(); ++it)
+        it->second->level = categoryLevel(table, it->first.c_str());
+      detail::maxVerbosity = maxLevel;
+    }
+
+    // Must be called with the table lock held.
+    static detail::Category *intern(CategoryTable &table, const char *name)
     {
-      if (!LogInit)
-        return;
+      if (!name)
+        name = "(null)";
+      CategoryMap::iterator it = table.categories.find(name);
+      if (it != table.categories.end())
+        return it->second;
 
-      LogInit = false;
+      detail::Category *c = new detail::Category;
+      it = table.categories.insert(std::make_pair(std::string(name), c)).first;
+      c->name = it->first.c_str();
+      c->level = categoryLevel(table, name);
+      c->id = table.categories.size() - 1;
 
-      if (!_glSyncLog)
+      char *padded = new char[CAT_PADDED + 1];
+      detail::padCategory(name, padded);
+      c->padded = padded;
+      c->throttle = detail::newThrottle(c, 0);
+      c->stats = new detail::CategoryStats;
+      c->stats->logged.store(0);
+      indexCategory(c);
+      return c;
+    }
+
+    namespace detail {
+      Category *category(const char *name)
       {
-        LogThread.interrupt();
-        LogThread.join();
+        if (!name)
+          name = "(null)";
+        if (Category *c = findCategory(name))
+          return c;
+        CategoryTable &table = categoryTable();
+        boost::mutex::scoped_lock l(table.lock);
+        return intern(table, name);
+      }
 
-        printLog();
+      Category *resolveCategory(CallSite   *site,
+                                const char *name,
+                                bool        constantName,
+                                const char *file,
+                                const char *function,
+                                int         line)
+      {
+        // a site logging to another category than its first one
+        if (siteCategory(*site))
+          return category(name);
+        CategoryTable &table = categoryTable();
+        boost::mutex::scoped_lock l(table.lock);
+        Category *c = intern(table, name);
+        if (!site->category)
+        {
+          site->name = constantName ? name : 0;
+          site->file = file;
+          site->function = function;
+          site->line = line;
+          site->next = table.sites;
+          table.sites = site;
+          site->throttle = newThrottle(c, site);
+          // isVisible reads the site without lock: publish its fields first
+          reinterpret_cast<boost::atomic<Category*>*>(&site->category)
+            ->store(c, boost::memory_order_release);
+        }
+        return c;
       }
     }
 
-    static void my_strcpy_log(char *dst, const char *src, int len) {
-      if (!src)
-        src = "(null)";
+    // The scratch of the thread, or one of its own for a handler logging
+    // from a synchronous delivery.
+    class ScratchGuard
+    {
+    public:
+      ScratchGuard()
+        : _own(0)
+      {
+        _scratch = LogLocalScratch.get();
+        if (!_scratch)
+        {
+          _scratch = new SyncScratch;
+          _scratch->busy = false;
+          LogLocalScratch.reset(_scratch);
+        }
+        if (_scratch->busy)
+          _scratch = _own = new SyncScratch;
+        _scratch->busy = true;
+      }
 
-      int messSize = strlen(src);
-      // check if the last char is a \n
-      if (src[messSize - 1] == '\n')
-      {
-        // Get the size to memcpy (don't forget we need 1 space more for \0)
-        int strSize = messSize < len  ? messSize : len - 1;
-       #ifndef _WIN32
-        memcpy(dst, src, strSize);
-       #else
-        memcpy_s(dst, len,  src, strSize);
-       #endif
-        dst[strSize] = 0;
-        return;
+      ~ScratchGuard()
+      {
+        if (_own)
+          delete _own;
+        else
+          _scratch->busy = false;
       }
 
-     #ifndef _WIN32
-      // Get the size to memcpy (we need 2 spaces more for \n\0)
-      int strSize = messSize < len - 1  ? messSize : len - 2;
-      memcpy(dst, src, strSize);
-      dst[strSize] = '\n';
-      dst[strSize + 1] = '\0';
-     #else
-      // Get the size to memcpy (we need 3 spaces more for \r\n\0)
-      int strSize = messSize < len - 2  ? messSize : len - 3;
-      memcpy_s(dst, len,  src, strSize);
-      dst[strSize] = '\r';
-      dst[strSize + 1] = '\n';
-      dst[strSize + 2] = '\0';
-     #endif
-    }
+      SyncScratch *operator->() const
+      {
+        return _scratch;
+      }
 
-    static void my_strcpy(char *dst, const char *src, int len) {
-      if (!src)
-        src = "(null)";
-     #ifdef _MSV_VER
-      strncpy_s(dst, len, src, _TRUNCATE);
-     #else
-      strncpy(dst, src, len);
-      dst[len - 1] = 0;
-     #endif
-    }
+    private:
+      SyncScratch *_scratch;
+      SyncScratch *_own;
+    };
 
-    void init(qi::log::LogLevel verb,
-              int ctx,
-              bool synchronous)
+    static void logRecord(Log                    *log,
+                          const LogLevel          verb,
+                          const detail::Category *category,
+                          const detail::CallSite *site,
+                          const char             *msg,
+                          const char             *file,
+                          const char             *fct,
+                          const int               line,
+                          const detail::LogArgs  *args,
+                          const detail::LogFields *fields)
     {
-      setVerbosity(verb);
-      setContext(ctx);
-      setSynchronousLog(synchronous);
+      RecordSource src;
+      prepareRecord(&src, verb, category, site, msg, file, fct, line, args, fields);
+      // before the ring, to keep the records dropped on overflow
+      detail::crashRecord(verb, src.timestamp, category->name, src.file, src.fct,
+                          src.line, args, fields, src.msg, src.messageLen);
 
-      if (_glInit)
-        destroy();
+      if (_glSyncLog)
+      {
+        ScratchGuard scratch;
+        writeRecord(scratch->record.bytes, recordSize(src, RTLOG_MAX_RECORD), src);
+        scratch->record.header.seq = 0;
+        countLogged(verb, category);
+        log->dispatch(&scratch->record.header, scratch->text, scratch->fields);
+        return;
+      }
 
-      _glConsoleLogHandler = new ConsoleLogHandler;
-      LogInstance          = new Log;
-      addLogHandler("consoleloghandler",
-                    boost::bind(&ConsoleLogHandler::log,
-                                _glConsoleLogHandler,
-                                _1, _2, _3, _4, _5, _6, _7));
-      _glInit = true;
+      ProducerRing *ring = localRing(log->ringSize);
+      unsigned int size = recordSize(src, ring->maxRecord());
+      unsigned long head = ring->_head.load(boost::memory_order_relaxed);
+      unsigned int need = ring->need(head, size);
+      RecordHeader *spill = 0;
+      if (head + need - ring->_tail.load(boost::memory_order_acquire) <= ring->_size ||
+          log->overflow(ring, head, need, verb, &spill))
+      {
+        if (spill)
+        {
+          writeRecord(reinterpret_cast<char*>(spill), recordSize(src, RTLOG_SPILL_SIZE), src);
+          spill->seq = LogSequence.fetch_add(1, boost::memory_order_relaxed);
+          log->spilled.enqueue(spill);
+        }
+        else
+        {
+          head = ring->place(head, size);
+          RecordHeader *h = ring->at(head);
+          writeRecord(reinterpret_cast<char*>(h), size, src);
+          h->seq = LogSequence.fetch_add(1, boost::memory_order_relaxed);
+          ring->_head.store(head + size, boost::memory_order_release);
+        }
+        countLogged(verb, category);
+      }
+      log->wake();
     }
 
-    void destroy()
+    static void reportSuppressed(Log              *log,
+                                 detail::Throttle *t,
+                                 boost::uint64_t   now,
+                                 bool              repeats,
+                                 bool              force)
     {
-      if (!_glInit)
+      unsigned long repeated;
+      unsigned long limited;
+      if (!detail::takeReport(t, now, repeats, force, &repeated, &limited))
         return;
-      _glInit = false;
-      LogInstance->printLog();
-      delete _glConsoleLogHandler;
-      _glConsoleLogHandler = 0;
-      delete LogInstance;
-      LogInstance = 0;
+      LogLevel verb = (LogLevel)t->level.load(boost::memory_order_relaxed);
+      const char *file = t->site ? t->site->file : "";
+      const char *fct = t->site ? t->site->function : "";
+      int line = t->site ? t->site->line : 0;
+      if (repeated)
+      {
+        std::ostringstream ss;
+        ss << "last message repeated " << repeated << " times";
+        logRecord(log, verb, t->category, t->site, ss.str().c_str(), file, fct, line, 0, 0);
+      }
+      if (limited)
+      {
+        std::ostringstream ss;
+        ss << limited << " messages suppressed by the rate limit";
+        logRecord(log, verb, t->category, t->site, ss.str().c_str(), file, fct, line, 0, 0);
+      }
     }
 
-    void flush()
+    // Report the records suppressed by the throttles, only those not
+    // reported for an interval unless force is set.
+    static void reportSuppressed(Log *log, bool force)
     {
-      if (_glInit)
-        LogInstance->printLog();
+      if (!detail::takeReportPending())
+        return;
+      boost::uint64_t now = detail::timestamp();
+      for (detail::Throttle *t = detail::throttles(); t; t = t->next)
+        reportSuppressed(log, t, now, false, force);
+    }
+
+    // Rate limit and repeat suppression, before the record is queued. The
+    // pending reports of the throttle go first.
+    static bool throttle(Log                    *log,
+                         const LogLevel          verb,
+                         const detail::Category *category,
+                         const detail::CallSite *site,
+                         const char             *msg,
+                         const detail::LogArgs  *args,
+                         const detail::LogFields *fields)
+    {
+      detail::Throttle *t = site ? site->throttle : category->throttle;
+      boost::uint64_t now = detail::timestamp();
+      if (!detail::admit(t, verb, msg ? msg : "(null)", args, fields, now))
+        return false;
+      reportSuppressed(log, t, now, true, false);
+      return true;
     }
 
+    // Registers a log call for its duration, with the instance it uses.
+    // The caller registers then reads the instance, destroy() unpublishes
+    // the instance then counts the callers: one of them sees the other.
+    class CallerGuard
+    {
+    public:
+      CallerGuard()
+      {
+        LogCallers.fetch_add(1);
+        _log = LogInstance.load();
+      }
+
+      ~CallerGuard()
+      {
+        LogCallers.fetch_sub(1);
+      }
+
+      // whether the call has an instance to log to
+      bool accepted(const LogLevel verb)
+      {
+        if (_log)
+          return true;
+        if (detail::isVisible(verb))
+          LogLost.fetch_add(1, boost::memory_order_relaxed);
+        return false;
+      }
+
+      Log *log() const
+      {
+        return _log;
+      }
+
+    private:
+      Log *_log;
+    };
+
     void log(const LogLevel        verb,
              const char           *category,
              const char           *msg,
@@ -236,66 +1842,288 @@ namespace qi {
              const int             line)
 
     {
-      if (!LogInstance)
+      CallerGuard guard;
+      if (!guard.accepted(verb))
+        return;
+      if (!detail::isVisible(verb))
+        return;
+      detail::Category *c = detail::category(category);
+      if (verb > c->level)
         return;
-      if (!LogInstance->LogInit)
+      if (detail::throttledLevel[verb] && !throttle(guard.log(), verb, c, 0, msg, 0, 0))
         return;
 
-      int tmpRtLogPush = ++LogPush % RTLOG_BUFFERS;
-      privateLog* pl = &(LogBuffer[tmpRtLogPush]);
+      logRecord(guard.log(), verb, c, 0, msg, file, fct, line, 0, 0);
+    }
+
+    namespace detail {
+      void log(const CallSite        *site,
+               const LogLevel         verb,
+               const char            *category,
+               const char            *msg,
+               const char            *file,
+               const char            *fct,
+               const int              line,
+               const LogArgs         *args,
+               const LogFields       *fields)
+      {
+        CallerGuard guard;
+        if (!guard.accepted(verb))
+          return;
+
+        // the site caches its first category only, and does not describe
+        // the records of the others
+        const Category *c = site ? siteCategory(*site) : 0;
+        const CallSite *s = c ? site : 0;
+        if (!c || !category || (category != s->name && strcmp(c->name, category) != 0))
+        {
+          c = detail::category(category);
+          s = 0;
+        }
+        if (!site && (!isVisible(verb) || verb > c->level))
+          return;
+        if (throttledLevel[verb] && !throttle(guard.log(), verb, c, s, msg, args, fields))
+          return;
+        logRecord(guard.log(), verb, c, s, msg, file, fct, line, args, fields);
+      }
+    }
 
-      qi::os::timeval tv;
-      qi::os::gettimeofday(&tv);
+    std::vector<LogCallSite> callSites()
+    {
+      std::vector<LogCallSite> result;
+      CategoryTable &table = categoryTable();
+      boost::mutex::scoped_lock l(table.lock);
+      for (detail::CallSite *site = table.sites; site; site = site->next)
+      {
+        LogCallSite cs;
+        cs.file = site->file;
+        cs.function = site->function;
+        cs.line = site->line;
+        cs.category = site->category->name;
+        cs.categoryId = site->category->id;
+        result.push_back(cs);
+      }
+      return result;
+    }
 
-      pl->_logLevel = verb;
-      pl->_line = line;
-      pl->_date.tv_sec = tv.tv_sec;
-      pl->_date.tv_usec = tv.tv_usec;
+    unsigned long droppedLogs()
+    {
+      unsigned long count = 0;
+      for (int i = silent; i <= debug; ++i)
+        count += LogDropped[i].load(boost::memory_order_relaxed);
+      return count;
+    }
 
-      my_strcpy(pl->_category, category, CAT_SIZE);
-      my_strcpy(pl->_file, file, FILE_SIZE);
-      my_strcpy(pl->_function, fct, FUNC_SIZE);
-      my_strcpy_log(pl->_log, msg, LOG_SIZE);
+    unsigned long droppedLogs(const LogLevel verb)
+    {
+      return LogDropped[verb].load(boost::memory_order_relaxed);
+    }
 
-      if (_glSyncLog)
+    // Message followed by the rendered fields, and the newline.
+    static const char *renderFields(const LogRecord &r, char *text)
+    {
+      unsigned int len = strlen(r.message);
+      while (len && (r.message[len - 1] == '\n' || r.message[len - 1] == '\r'))
+        --len;
+      len = std::min(len, (unsigned int)LOG_SIZE / 2);
+      memcpy(text, r.message, len);
+      unsigned int size = LOG_SIZE - len - sizeof(LOG_NEWLINE);
+      unsigned int n = formatFields(r, text + len, size);
+      // no leading space when there is no text
+      if (!len && n)
+      {
+        memmove(text, text + 1, n);
+        --n;
+      }
+      memcpy(text + len + n, LOG_NEWLINE, sizeof(LOG_NEWLINE));
+      return text;
+    }
+
+    // Adapter giving a batch to a per record handler, the fields are
+    // rendered in the message.
+    static void logEach(logFuncHandler fct, const LogRecord *records, unsigned int count)
+    {
+      char text[LOG_SIZE];
+      for (unsigned int i = 0; i < count; ++i)
+      {
+        const LogRecord &r = records[i];
+        const char *message = r.fieldCount ? renderFields(r, text) : r.message;
+        fct(r.level, r.date, r.category, message, r.file, r.function, r.line);
+      }
+    }
+
+    void addLogHandler(const std::string& name, logFuncHandler fct, unsigned int queueSize)
+    {
+      addLogBatchHandler(name, boost::bind(&logEach, fct, _1, _2), queueSize);
+    }
+
+    void addLogBatchHandler(const std::string& name, logBatchFuncHandler fct, unsigned int queueSize)
+    {
+      Log *log = LogInstance.load();
+      if (!log)
+        return;
+      log->setHandler(name, &fct, queueSize);
+    }
+
+    void setLogHandlerFlush(const std::string& name, logFlushFuncHandler fct)
+    {
+      Log *log = LogInstance.load();
+      if (!log)
+        return;
+      log->setHandlerFlush(name, fct);
+    }
+
+    static void handlerCounters(const Handler &handler, LogHandlerStats *stats)
+    {
+      stats->name = handler.name;
+      stats->delivered = handler.counters->records.load(boost::memory_order_relaxed);
+      stats->calls = handler.counters->calls.load(boost::memory_order_relaxed);
+      for (int i = 0; i < LogHistogramSize; ++i)
+        stats->time[i] = handler.counters->time[i].load(boost::memory_order_relaxed);
+      stats->dropped = 0;
+      stats->lag = 0;
+      if (handler.worker)
+      {
+        stats->dropped = handler.worker->dropped.load(boost::memory_order_relaxed);
+        stats->lag = handler.worker->queued.load(boost::memory_order_relaxed) - stats->delivered;
+      }
+    }
+
+    LogHandlerStats handlerStats(const std::string& name)
+    {
+      LogHandlerStats stats;
+      stats.name = name;
+      stats.delivered = 0;
+      stats.dropped = 0;
+      stats.lag = 0;
+      stats.calls = 0;
+      for (int i = 0; i < LogHistogramSize; ++i)
+        stats.time[i] = 0;
+      Log *log = LogInstance.load();
+      if (!log)
+        return stats;
+      HandlerReader reader(log);
+      const HandlerList *list = reader.handlers();
+      HandlerList::const_iterator it;
+      for (it = list->begin(); it != list->end(); ++it)
+      {
+        if (it->name == name)
+          handlerCounters(*it, &stats);
+      }
+      return stats;
+    }
+
+    LogStats stats()
+    {
+      LogStats stats;
+      for (int i = silent; i <= debug; ++i)
+      {
+        stats.logged[i] = LogLogged[i].load(boost::memory_order_relaxed);
+        stats.dropped[i] = LogDropped[i].load(boost::memory_order_relaxed);
+      }
+      stats.suppressed = suppressedLogs();
+      stats.lost = LogLost.load(boost::memory_order_relaxed);
+      for (int i = 0; i < LogHistogramSize; ++i)
+        stats.latency[i] = LogLatency[i].load(boost::memory_order_relaxed);
+
+      stats.rings = 0;
+      stats.queuedBytes = 0;
+      stats.ringBytes = 0;
       {
-        if (!LogInstance->logHandlers.empty())
+        boost::mutex::scoped_lock l(LogRingsLock);
+        for (unsigned int i = 0; i < LogRings.size(); ++i)
         {
-          std::map<std::string, logFuncHandler >::iterator it;
-          for (it = LogInstance->logHandlers.begin();
-               it != LogInstance->logHandlers.end(); ++it)
-          {
-            (*it).second(pl->_logLevel,
-                         pl->_date,
-                         pl->_category,
-                         pl->_log,
-                         pl->_file,
-                         pl->_function,
-                         pl->_line);
-          }
+          ProducerRing *ring = LogRings[i];
+          ++stats.rings;
+          stats.queuedBytes += ring->_head.load(boost::memory_order_relaxed)
+            - ring->_tail.load(boost::memory_order_relaxed);
+          stats.ringBytes += ring->_size;
         }
       }
-      else
+
+      Log *log = LogInstance.load();
+      if (log)
+      {
+        HandlerReader reader(log);
+        const HandlerList *list = reader.handlers();
+        stats.handlers.resize(list->size());
+        for (unsigned int i = 0; i < list->size(); ++i)
+          handlerCounters((*list)[i], &stats.handlers[i]);
+      }
+
+      CategoryTable &table = categoryTable();
+      boost::mutex::scoped_lock l(table.lock);
+      CategoryMap::const_iterator it;
+      for (it = table.categories.begin(); it != table.categories.end(); ++it)
+      {
+        LogCategoryStats cs;
+        cs.name = it->second->name;
+        cs.logged = it->second->stats->logged.load(boost::memory_order_relaxed);
+        stats.categories.push_back(cs);
+      }
+      return stats;
+    }
+
+    // Upper bound, in microseconds, of the bucket holding the p percent
+    // shortest durations.
+    static unsigned long percentile(const unsigned long *histogram, unsigned int p)
+    {
+      unsigned long total = 0;
+      for (int i = 0; i < LogHistogramSize; ++i)
+        total += histogram[i];
+      unsigned long rank = (total * p + 99) / 100;
+      unsigned long seen = 0;
+      for (int i = 0; i < LogHistogramSize && total; ++i)
       {
-        LogInstance->logs.enqueue(pl);
-        LogInstance->LogReadyCond.notify_one();
+        seen += histogram[i];
+        if (seen >= rank)
+          return 1ul << i;
       }
+      return 0;
     }
 
-    void addLogHandler(const std::string& name, logFuncHandler fct)
+    // Log the main counters under the "qi.log.stats" category.
+    static void reportStats(Log *log)
     {
-      if (!LogInstance)
+      detail::Category *c = detail::category("qi.log.stats");
+      if (info > c->level)
         return;
-      boost::mutex::scoped_lock l(LogInstance->LogHandlerLock);
-      LogInstance->logHandlers[name] = fct;
+
+      LogStats s = stats();
+      unsigned long logged = 0;
+      unsigned long dropped = 0;
+      for (int i = silent; i <= debug; ++i)
+      {
+        logged += s.logged[i];
+        dropped += s.dropped[i];
+      }
+
+      detail::LogFields fields;
+      fields.size = 0;
+      fields.count = 0;
+      LogField field;
+      field.type = uintField;
+      field.value.u = logged;
+      detail::addField(&fields, "logged", field);
+      field.value.u = dropped;
+      detail::addField(&fields, "dropped", field);
+      field.value.u = s.suppressed;
+      detail::addField(&fields, "suppressed", field);
+      field.value.u = s.queuedBytes;
+      detail::addField(&fields, "queued", field);
+      field.value.u = percentile(s.latency, 50);
+      detail::addField(&fields, "latency_p50_us", field);
+      field.value.u = percentile(s.latency, 99);
+      detail::addField(&fields, "latency_p99_us", field);
+      logRecord(log, info, c, 0, "log statistics", "", "", 0, 0, &fields);
     }
 
     void removeLogHandler(const std::string& name)
     {
-      if (!LogInstance)
+      Log *log = LogInstance.load();
+      if (!log)
         return;
-      boost::mutex::scoped_lock l(LogInstance->LogHandlerLock);
-      LogInstance->logHandlers.erase(name);
+      log->setHandler(name, 0, 0);
     }
 
     const LogLevel stringToLogLevel(const char* verb)
@@ -332,14 +2160,57 @@ namespace qi {
       return sverb[verb];
     }
 
+    // Must be called with the table lock held. Setting a pattern again
+    // only changes its level, it keeps its rank.
+    static void setRule(CategoryTable     &table,
+                        const std::string &pattern,
+                        const LogLevel     level)
+    {
+      CategoryRules::iterator it;
+      for (it = table.rules.begin(); it != table.rules.end(); ++it)
+      {
+        if (it->first == pattern)
+        {
+          it->second = level;
+          return;
+        }
+      }
+      table.rules.push_back(std::make_pair(pattern, level));
+    }
+
+    static LogLevel parseLogLevel(const std::string &level)
+    {
+      if (!level.empty() && isdigit(level[0]))
+        return (LogLevel)atoi(level.c_str());
+      return stringToLogLevel(level.c_str());
+    }
+
     void setVerbosity(const LogLevel lv)
     {
       const char *verbose = std::getenv("VERBOSE");
+      const char *categories = std::getenv("VERBOSE_CATEGORIES");
 
+      CategoryTable &table = categoryTable();
+      boost::mutex::scoped_lock l(table.lock);
       if (verbose)
         _glVerbosity = (LogLevel)atoi(verbose);
       else
         _glVerbosity = lv;
+
+      // comma separated list of pattern=level, e.g. "motion.*=debug,audio=3"
+      if (categories)
+      {
+        std::stringstream ss(categories);
+        std::string rule;
+        while (std::getline(ss, rule, ','))
+        {
+          std::string::size_type eq = rule.find('=');
+          if (eq == std::string::npos || eq == 0)
+            continue;
+          setRule(table, rule.substr(0, eq), parseLogLevel(rule.substr(eq + 1)));
+        }
+      }
+      updateCategories(table);
     };
 
     LogLevel verbosity()
@@ -347,6 +2218,27 @@ namespace qi {
       return _glVerbosity;
     };
 
+    LogLevel verbosity(const std::string &category)
+    {
+      return detail::category(category.c_str())->level;
+    };
+
+    void setCategoryVerbosity(const std::string &pattern, const LogLevel lv)
+    {
+      CategoryTable &table = categoryTable();
+      boost::mutex::scoped_lock l(table.lock);
+      setRule(table, pattern, lv);
+      updateCategories(table);
+    };
+
+    void clearCategoryVerbosity()
+    {
+      CategoryTable &table = categoryTable();
+      boost::mutex::scoped_lock l(table.lock);
+      table.rules.clear();
+      updateCategories(table);
+    };
+
     void setContext(int ctx)
     {
       const char *context = std::getenv("CONTEXT");
@@ -365,6 +2257,50 @@ namespace qi {
     void setSynchronousLog(bool sync)
     {
       _glSyncLog = sync;
+      detail::deferredFormatting = _glDeferredFormatting && !_glSyncLog;
+    };
+
+    void setDeferredFormatting(bool deferred)
+    {
+      _glDeferredFormatting = deferred;
+      detail::deferredFormatting = _glDeferredFormatting && !_glSyncLog;
+    };
+
+    void setOverflowPolicy(LogOverflowPolicy policy, unsigned int blockTimeout)
+    {
+      _glOverflowPolicy = policy;
+      _glBlockTimeout = blockTimeout;
+    };
+
+    LogOverflowPolicy overflowPolicy()
+    {
+      return _glOverflowPolicy;
+    };
+
+    void setBufferSize(unsigned int bytes)
+    {
+      _glRingSize = ringBytes(bytes);
+    };
+
+    void setStatsReport(unsigned int interval)
+    {
+      _glStatsInterval = interval;
+    };
+
+    void setShutdownTimeout(unsigned int timeout)
+    {
+      _glShutdownTimeout = timeout;
+    }
+
+    void setWakeup(unsigned int maxLatency, unsigned int spin)
+    {
+      _glMaxLatency = maxLatency ? maxLatency : 1;
+      _glSpin = spin;
+    };
+
+    unsigned int bufferSize()
+    {
+      return _glRingSize;
     };
 
   } // namespace log
@@ -0,0 +1,415 @@
+/*
+ * Copyright (c) 2012 Aldebaran Robotics. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the COPYING file.
+ */
+
+#include <qi/log.hpp>
+#include "logargs.hpp"
+
+#include <cstring>
+#include <cstdio>
+#include <cctype>
+#include <cstddef>
+
+#ifdef _MSC_VER
+# define snprintf _snprintf
+#endif
+
+namespace qi {
+  namespace log {
+    namespace detail {
+
+      enum ArgType {
+        argNone = 0,
+        argInt,
+        argLong,
+        argLongLong,
+        argSize,
+        argPtrdiff,
+        argDouble,
+        argLongDouble,
+        argString,
+        argPointer
+      };
+
+      struct ArgSpec
+      {
+        int     length;     // characters after the '%'
+        ArgType type;
+        bool    starWidth;
+        bool    starPrecision;
+        int     precision;  // -1 when not given as a number
+      };
+
+      // Parse the conversion specification following a '%'. Fail on the
+      // ones we do not know how to copy (%n, wide characters, %I64d...).
+      static bool parseSpec(const char *spec, ArgSpec *res)
+      {
+        const char *p = spec;
+        res->starWidth = false;
+        res->starPrecision = false;
+        res->precision = -1;
+
+        while (*p && strchr("-+ #0", *p))
+          ++p;
+        if (*p == '*')
+        {
+          res->starWidth = true;
+          ++p;
+        }
+        while (isdigit(*p))
+          ++p;
+        if (*p == '.')
+        {
+          ++p;
+          if (*p == '*')
+          {
+            res->starPrecision = true;
+            ++p;
+          }
+          else
+          {
+            res->precision = 0;
+            while (isdigit(*p))
+              res->precision = res->precision * 10 + (*p++ - '0');
+          }
+        }
+
+        char length = 0;
+        switch (*p)
+        {
+        case 'h':
+          ++p;
+          if (*p == 'h')
+            ++p;
+          break;
+        case 'l':
+          ++p;
+          length = 'l';
+          if (*p == 'l')
+          {
+            ++p;
+            length = 'q';
+          }
+          break;
+        case 'z':
+        case 't':
+        case 'L':
+          length = *p++;
+          break;
+        default:
+          break;
+        }
+
+        switch (*p)
+        {
+        case 'd':
+        case 'i':
+        case 'u':
+        case 'o':
+        case 'x':
+        case 'X':
+          switch (length)
+          {
+          case 0:   res->type = argInt;      break;
+          case 'l': res->type = argLong;     break;
+          case 'q': res->type = argLongLong; break;
+          case 'z': res->type = argSize;     break;
+          case 't': res->type = argPtrdiff;  break;
+          default:  return false;
+          }
+          break;
+        case 'c':
+          if (length)
+            return false;
+          res->type = argInt;
+          break;
+        case 'e':
+        case 'E':
+        case 'f':
+        case 'F':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A':
+          if (length == 'L')
+            res->type = argLongDouble;
+          else if (length == 0 || length == 'l')
+            res->type = argDouble;
+          else
+            return false;
+          break;
+        case 's':
+          if (length)
+            return false;
+          res->type = argString;
+          break;
+        case 'p':
+          res->type = argPointer;
+          break;
+        case '%':
+          if (p != spec)
+            return false;
+          res->type = argNone;
+          break;
+        default:
+          return false;
+        }
+
+        res->length = p - spec + 1;
+        return true;
+      }
+
+      static bool put(LogArgs *args, const void *value, std::size_t size)
+      {
+        if (args->size + size > LogArgs::capacity)
+          return false;
+        memcpy(args->data + args->size, value, size);
+        args->size += size;
+        return true;
+      }
+
+      template <typename T>
+      static bool putArg(LogArgs *args, T value)
+      {
+        return put(args, &value, sizeof(T));
+      }
+
+      bool captureArgs(LogArgs *args, const char *fmt, va_list vl)
+      {
+        args->fmt = 0;
+        args->fmtSize = 0;
+        args->size = 0;
+        if (!fmt)
+          return false;
+        if (!put(args, fmt, strlen(fmt) + 1))
+          return false;
+        args->fmtSize = args->size;
+
+        for (const char *p = fmt; *p; ++p)
+        {
+          if (*p != '%')
+            continue;
+
+          ArgSpec spec;
+          if (!parseSpec(p + 1, &spec))
+            return false;
+          p += spec.length;
+
+          int precision = spec.precision;
+          if (spec.starWidth && !putArg(args, va_arg(vl, int)))
+            return false;
+          if (spec.starPrecision)
+          {
+            precision = va_arg(vl, int);
+            if (!putArg(args, precision))
+              return false;
+          }
+
+          bool ok = true;
+          switch (spec.type)
+          {
+          case argNone:
+            break;
+          case argInt:
+            ok = putArg(args, va_arg(vl, int));
+            break;
+          case argLong:
+            ok = putArg(args, va_arg(vl, long));
+            break;
+          case argLongLong:
+            ok = putArg(args, va_arg(vl, long long));
+            break;
+          case argSize:
+            ok = putArg(args, va_arg(vl, size_t));
+            break;
+          case argPtrdiff:
+            ok = putArg(args, va_arg(vl, ptrdiff_t));
+            break;
+          case argDouble:
+            ok = putArg(args, va_arg(vl, double));
+            break;
+          case argLongDouble:
+            ok = putArg(args, va_arg(vl, long double));
+            break;
+          case argPointer:
+            ok = putArg(args, va_arg(vl, void *));
+            break;
+          case argString:
+            {
+              // deep copy, the caller buffer may be gone when we format
+              const char *s = va_arg(vl, const char *);
+              if (!s)
+                s = "(null)";
+              std::size_t len;
+              if (precision >= 0)
+              {
+                const void *end = memchr(s, '\0', precision);
+                len = end ? (const char *)end - s : precision;
+              }
+              else
+              {
+                len = strlen(s);
+              }
+              ok = put(args, s, len) && putArg(args, '\0');
+              break;
+            }
+          }
+          if (!ok)
+            return false;
+        }
+
+        args->fmt = fmt;
+        return true;
+      }
+
+      // The data may come from a damaged crash ring: fail rather than
+      // read past its size.
+      template <typename T>
+      static bool getArg(const char   *data,
+                         unsigned int  size,
+                         unsigned int *offset,
+                         T            *value)
+      {
+        if (*offset > size || size - *offset < sizeof(T))
+          return false;
+        memcpy(value, data + *offset, sizeof(T));
+        *offset += sizeof(T);
+        return true;
+      }
+
+      template <typename T>
+      static int print(char       *buf,
+                       int         len,
+                       const char *spec,
+                       const int  *stars,
+                       int         nstars,
+                       T           value)
+      {
+        switch (nstars)
+        {
+        case 0:
+          return snprintf(buf, len, spec, value);
+        case 1:
+          return snprintf(buf, len, spec, stars[0], value);
+        default:
+          return snprintf(buf, len, spec, stars[0], stars[1], value);
+        }
+      }
+
+      template <typename T>
+      static bool printArg(char         *buf,
+                           int           len,
+                           const char   *spec,
+                           const int    *stars,
+                           int           nstars,
+                           const char   *data,
+                           unsigned int  size,
+                           unsigned int *offset,
+                           int          *n)
+      {
+        T value;
+        if (!getArg(data, size, offset, &value))
+          return false;
+        *n = print(buf, len, spec, stars, nstars, value);
+        return true;
+      }
+
+      int formatArgs(const char   *fmt,
+                     const char   *data,
+                     unsigned int  size,
+                     char         *buf,
+                     int           len)
+      {
+        int          pos = 0;
+        unsigned int offset = 0;
+        char         spec[32];
+
+        for (const char *p = fmt; *p && pos < len - 1; ++p)
+        {
+          if (*p != '%')
+          {
+            buf[pos++] = *p;
+            continue;
+          }
+
+          // a format cut inside a conversion ends the text
+          ArgSpec s;
+          if (!parseSpec(p + 1, &s))
+            break;
+          if (s.type == argNone)
+          {
+            buf[pos++] = '%';
+            p += s.length;
+            continue;
+          }
+          if (s.length + 2 > (int)sizeof(spec))
+            break;
+          memcpy(spec, p, s.length + 1);
+          spec[s.length + 1] = '\0';
+          p += s.length;
+
+          int stars[2];
+          int nstars = 0;
+          if (s.starWidth && !getArg(data, size, &offset, &stars[nstars++]))
+            break;
+          if (s.starPrecision && !getArg(data, size, &offset, &stars[nstars++]))
+            break;
+
+          char *out = buf + pos;
+          int avail = len - pos;
+          int n = 0;
+          bool ok = true;
+          switch (s.type)
+          {
+          case argInt:
+            ok = printArg<int>(out, avail, spec, stars, nstars, data, size, &offset, &n);
+            break;
+          case argLong:
+            ok = printArg<long>(out, avail, spec, stars, nstars, data, size, &offset, &n);
+            break;
+          case argLongLong:
+            ok = printArg<long long>(out, avail, spec, stars, nstars, data, size, &offset, &n);
+            break;
+          case argSize:
+            ok = printArg<size_t>(out, avail, spec, stars, nstars, data, size, &offset, &n);
+            break;
+          case argPtrdiff:
+            ok = printArg<ptrdiff_t>(out, avail, spec, stars, nstars, data, size, &offset, &n);
+            break;
+          case argDouble:
+            ok = printArg<double>(out, avail, spec, stars, nstars, data, size, &offset, &n);
+            break;
+          case argLongDouble:
+            ok = printArg<long double>(out, avail, spec, stars, nstars, data, size, &offset, &n);
+            break;
+          case argPointer:
+            ok = printArg<void *>(out, avail, spec, stars, nstars, data, size, &offset, &n);
+            break;
+          case argString:
+            {
+              const char *str = data + offset;
+              const void *end = offset < size ? memchr(str, '\0', size - offset) : 0;
+              if (!(ok = end != 0))
+                break;
+              offset = static_cast<const char*>(end) - data + 1;
+              n = print(out, avail, spec, stars, nstars, str);
+              break;
+            }
+          case argNone:
+            break;
+          }
+          if (!ok)
+            break;
+          // a negative result is a truncation with MSVC
+          if (n < 0 || n >= avail)
+            n = avail - 1;
+          pos += n;
+        }
+        buf[pos] = '\0';
+        return pos;
+      }
+    }
+  }
+}
@@ -0,0 +1,24 @@
+/*
+ * Copyright (c) 2012 Aldebaran Robotics. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the COPYING file.
+ */
+
+#ifndef   	LOGARGS_HPP_
+# define   	LOGARGS_HPP_
+
+namespace qi {
+  namespace log {
+    namespace detail {
+      // Format the arguments copied by captureArgs, return the length
+      // written in buf (always null terminated).
+      int formatArgs(const char   *fmt,
+                     const char   *data,
+                     unsigned int  size,
+                     char         *buf,
+                     int           len);
+    }
+  }
+} // namespace qi::log::detail
+
+#endif	    /* !LOGARGS_HPP_ */
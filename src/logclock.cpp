@@ -0,0 +1,173 @@
+/*
+ * Copyright (c) 2012 Aldebaran Robotics. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the COPYING file.
+ */
+
+#include <qi/log.hpp>
+#include <qi/os.hpp>
+#include "logclock.hpp"
+
+#include <boost/atomic.hpp>
+
+#ifdef _WIN32
+# include <windows.h>
+#elif defined(__APPLE__)
+# include <mach/mach_time.h>
+#else
+# include <time.h>
+#endif
+
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+# include <intrin.h>
+# define HAVE_TSC
+#elif defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+# define HAVE_TSC
+#endif
+
+// Interval between two readings of the wall clock, in nanoseconds.
+#define WALLCLOCK_PERIOD 1000000000LL
+
+namespace qi {
+  namespace log {
+
+    // tscClock calibration: nanoseconds = base + (tsc - ticks) * period
+    struct TscCalibration
+    {
+      boost::uint64_t ticks;
+      boost::uint64_t base;
+      double          period;
+    };
+
+    static boost::atomic<int>        _glTimestampClock(monotonicClock);
+    // Read without lock by timestamp(): the calibration is made once,
+    // never changed once published, nor freed.
+    static boost::atomic<const TscCalibration*> _glTsc;
+    // wall clock minus timestamp, and the timestamp it was measured at
+    static boost::atomic<long long>  _glWallOffset(0);
+    static boost::atomic<long long>  _glWallMeasured(-WALLCLOCK_PERIOD);
+
+    static boost::uint64_t monotonicNs(bool coarse)
+    {
+#ifdef _WIN32
+      static LARGE_INTEGER frequency = { 0 };
+      if (!frequency.QuadPart)
+        QueryPerformanceFrequency(&frequency);
+      LARGE_INTEGER now;
+      QueryPerformanceCounter(&now);
+      return (boost::uint64_t)((double)now.QuadPart * 1e9 / (double)frequency.QuadPart);
+#elif defined(__APPLE__)
+      static mach_timebase_info_data_t timebase = { 0, 0 };
+      if (!timebase.denom)
+        mach_timebase_info(&timebase);
+      return mach_absolute_time() * timebase.numer / timebase.denom;
+#else
+      struct timespec ts;
+# ifdef CLOCK_MONOTONIC_COARSE
+      clock_gettime(coarse ? CLOCK_MONOTONIC_COARSE : CLOCK_MONOTONIC, &ts);
+# else
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+# endif
+      return (boost::uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+    }
+
+#ifdef HAVE_TSC
+    static inline boost::uint64_t readTsc()
+    {
+# ifdef _MSC_VER
+      return __rdtsc();
+# else
+      unsigned int lo, hi;
+      __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+      return ((boost::uint64_t)hi << 32) | lo;
+# endif
+    }
+
+    // Measure the cycle counter against the monotonic clock for 10ms.
+    static const TscCalibration *calibrateTsc()
+    {
+      boost::uint64_t ns0 = monotonicNs(false);
+      boost::uint64_t ticks0 = readTsc();
+      boost::uint64_t ns1;
+      do
+        ns1 = monotonicNs(false);
+      while (ns1 - ns0 < 10000000);
+      boost::uint64_t ticks1 = readTsc();
+
+      TscCalibration *tsc = new TscCalibration;
+      tsc->period = (double)(ns1 - ns0) / (double)(ticks1 - ticks0);
+      tsc->ticks = ticks1;
+      tsc->base = ns1;
+      return tsc;
+    }
+#endif
+
+    namespace detail {
+      boost::uint64_t timestamp()
+      {
+        switch (_glTimestampClock.load(boost::memory_order_acquire))
+        {
+#ifdef HAVE_TSC
+        case tscClock:
+        {
+          // published before the clock
+          const TscCalibration *tsc = _glTsc.load(boost::memory_order_acquire);
+          return tsc->base + (boost::int64_t)((boost::int64_t)(readTsc() - tsc->ticks) * tsc->period);
+        }
+#endif
+        case coarseClock:
+          return monotonicNs(true);
+        case monotonicClock:
+        default:
+          return monotonicNs(false);
+        }
+      }
+
+      void wallClock(boost::uint64_t timestamp, qi::os::timeval *date)
+      {
+        // Follow the wall clock changes: read it again once per period,
+        // by the first thread to notice the period is over.
+        long long measured = _glWallMeasured.load(boost::memory_order_relaxed);
+        if ((long long)timestamp - measured >= WALLCLOCK_PERIOD &&
+            _glWallMeasured.compare_exchange_strong(measured, (long long)timestamp))
+        {
+          qi::os::timeval tv;
+          qi::os::gettimeofday(&tv);
+          long long wall = (long long)tv.tv_sec * 1000000000LL + (long long)tv.tv_usec * 1000;
+          _glWallOffset.store(wall - (long long)detail::timestamp(), boost::memory_order_relaxed);
+        }
+
+        long long ns = (long long)timestamp + _glWallOffset.load(boost::memory_order_relaxed);
+        date->tv_sec = (long)(ns / 1000000000LL);
+        date->tv_usec = (long)(ns % 1000000000LL / 1000);
+      }
+    }
+
+    void setTimestampClock(LogClock clock)
+    {
+#ifdef HAVE_TSC
+      if (clock == tscClock && !_glTsc.load(boost::memory_order_acquire))
+      {
+        const TscCalibration *expected = 0;
+        const TscCalibration *tsc = calibrateTsc();
+        // another thread may have calibrated meanwhile
+        if (!_glTsc.compare_exchange_strong(expected, tsc, boost::memory_order_acq_rel))
+          delete tsc;
+      }
+#else
+      if (clock == tscClock)
+        clock = monotonicClock;
+#endif
+      _glTimestampClock.store(clock, boost::memory_order_release);
+      // the origin may have changed, measure the wall clock again
+      _glWallMeasured.store((long long)detail::timestamp() - WALLCLOCK_PERIOD);
+    }
+
+    LogClock timestampClock()
+    {
+      return (LogClock)_glTimestampClock.load();
+    }
+
+  } // namespace log
+} // namespace qi
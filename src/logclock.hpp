@@ -0,0 +1,25 @@
+/*
+ * Copyright (c) 2012 Aldebaran Robotics. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the COPYING file.
+ */
+
+#ifndef   	LOGCLOCK_HPP_
+# define   	LOGCLOCK_HPP_
+
+# include <boost/cstdint.hpp>
+# include <qi/os.hpp>
+
+namespace qi {
+  namespace log {
+    namespace detail {
+      // Monotonic nanoseconds from the clock chosen with setTimestampClock.
+      boost::uint64_t timestamp();
+
+      // Wall clock date of a timestamp.
+      void wallClock(boost::uint64_t timestamp, qi::os::timeval *date);
+    }
+  }
+} // namespace qi::log::detail
+
+#endif	    /* !LOGCLOCK_HPP_ */
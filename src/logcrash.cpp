@@ -0,0 +1,435 @@
+/*
+ * Copyright (c) 2012 Aldebaran Robotics. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the COPYING file.
+ */
+
+#include <qi/log.hpp>
+#include <qi/os.hpp>
+#include "logcrash.hpp"
+#include "logargs.hpp"
+#include "logfields.hpp"
+#include "logclock.hpp"
+#include "logoutput.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+#include <boost/atomic.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/function.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/tss.hpp>
+
+#define CRASH_MAGIC "QILOGCR1"
+// Longest strings kept in a crash record.
+#define CRASH_CATEGORY_SIZE 128
+#define CRASH_FILE_SIZE 128
+#define CRASH_FUNC_SIZE 64
+#define CRASH_FORMAT_SIZE 256
+#define CRASH_MESSAGE_SIZE 2048
+// Records given at once to the handler of readCrashRing.
+#define CRASH_BATCH 64
+// Marks the padding records skipping the end of the ring.
+#define CRASH_PADDING 0xff
+// Largest chunk of the ring reserved at once by a thread.
+#define CRASH_CHUNK_SIZE 4096
+
+#define CRASH_ALIGN(size) (((size) + 7) & ~7u)
+
+namespace qi {
+  namespace log {
+
+    /*
+     * The file is a header followed by the ring. Records are written by
+     * any thread: a thread reserves a chunk of the ring by moving head,
+     * then writes its records one after the other in the chunk, each
+     * committed by setting its commit field last, to its position in 8
+     * bytes units plus one. Nothing is ever freed, new chunks overwrite
+     * the oldest ones. A reader recognizes the records by their commit
+     * field, skips what was torn, overwritten or left unused at the end
+     * of a chunk, and orders the records by timestamp.
+     */
+    struct CrashRingHeader
+    {
+      char             magic[8];
+      boost::uint32_t  headerSize;
+      boost::uint32_t  pid;
+      // bytes of the ring, a power of two
+      boost::uint64_t  size;
+      // bytes reserved since the creation of the ring
+      boost::uint64_t  head;
+      char             reserved[32];
+    };
+
+    struct CrashRecordHeader
+    {
+      // bytes up to the next record
+      boost::uint32_t  size;
+      boost::uint32_t  commit;
+      boost::uint64_t  timestamp;
+      boost::int64_t   seconds;
+      boost::int32_t   microseconds;
+      boost::int32_t   line;
+      boost::uint8_t   level;
+      boost::uint8_t   unused;
+      boost::uint16_t  categoryLen;
+      boost::uint16_t  fileLen;
+      boost::uint16_t  functionLen;
+      boost::uint16_t  formatLen;
+      boost::uint16_t  argsSize;
+      boost::uint16_t  fieldsSize;
+      boost::uint16_t  messageLen;
+    };
+
+    class CrashRing
+    {
+    public:
+      CrashRing(const std::string &path, unsigned int size)
+        : _file(path.c_str(), boost::interprocess::read_write)
+        , _region(_file, boost::interprocess::read_write)
+      {
+        header = static_cast<CrashRingHeader*>(_region.get_address());
+        data = static_cast<char*>(_region.get_address()) + sizeof(CrashRingHeader);
+        memset(header, 0, sizeof(CrashRingHeader));
+        header->headerSize = sizeof(CrashRingHeader);
+        header->pid = qi::os::getpid();
+        header->size = size;
+        head()->store(0);
+        boost::atomic_thread_fence(boost::memory_order_release);
+        memcpy(header->magic, CRASH_MAGIC, sizeof(header->magic));
+      }
+
+      boost::atomic<boost::uint64_t> *head()
+      {
+        return reinterpret_cast<boost::atomic<boost::uint64_t>*>(&header->head);
+      }
+
+      CrashRingHeader  *header;
+      char             *data;
+
+    private:
+      boost::interprocess::file_mapping   _file;
+      boost::interprocess::mapped_region  _region;
+    };
+
+    static boost::atomic<CrashRing*>  _glCrashRing(0);
+    // rings are kept mapped until the end of the process, a thread may
+    // still be writing in the previous one
+    static boost::mutex               _glCrashRingsLock;
+    static std::vector<CrashRing*>    _glCrashRings;
+
+    // Part of the ring reserved by a thread and not written yet.
+    struct CrashChunk
+    {
+      CrashRing        *ring;
+      boost::uint64_t   pos;
+      boost::uint64_t   end;
+    };
+
+    static boost::thread_specific_ptr<CrashChunk> _glCrashChunk;
+
+    // Reserve size bytes of the ring, return their position.
+    static boost::uint64_t crashReserve(CrashRing *ring, unsigned int size)
+    {
+      boost::uint64_t ringSize = ring->header->size;
+      boost::uint64_t head = ring->head()->load(boost::memory_order_relaxed);
+      boost::uint64_t left;
+      do
+      {
+        left = ringSize - (head & (ringSize - 1));
+      }
+      while (!ring->head()->compare_exchange_weak(head, head + (size <= left ? size : left + size),
+                                                  boost::memory_order_relaxed));
+      if (size > left)
+      {
+        // skip the end of the ring, the reader also skips what is
+        // shorter than a header
+        if (left >= sizeof(CrashRecordHeader))
+        {
+          CrashRecordHeader *padding =
+            reinterpret_cast<CrashRecordHeader*>(ring->data + (head & (ringSize - 1)));
+          padding->size = (boost::uint32_t)left;
+          padding->level = CRASH_PADDING;
+          boost::atomic_thread_fence(boost::memory_order_release);
+          padding->commit = (boost::uint32_t)(head / 8 + 1);
+        }
+        head += left;
+      }
+      return head;
+    }
+
+    static boost::uint16_t crashLength(const char *str, unsigned int max)
+    {
+      unsigned int len = 0;
+      while (len < max - 1 && str[len])
+        ++len;
+      return len;
+    }
+
+    static char *crashCopy(char *dst, const char *src, unsigned int len)
+    {
+      memcpy(dst, src, len);
+      dst[len] = '\0';
+      return dst + len + 1;
+    }
+
+    namespace detail {
+      void crashRecord(LogLevel         verb,
+                       boost::uint64_t  timestamp,
+                       const char      *category,
+                       const char      *file,
+                       const char      *function,
+                       int              line,
+                       const LogArgs   *args,
+                       const LogFields *fields,
+                       const char      *msg,
+                       unsigned int     msgLen)
+      {
+        CrashRing *ring = _glCrashRing.load(boost::memory_order_acquire);
+        if (!ring)
+          return;
+
+        CrashRecordHeader h;
+        h.timestamp = timestamp;
+        h.line = line;
+        h.level = verb;
+        h.unused = 0;
+        h.categoryLen = crashLength(category, CRASH_CATEGORY_SIZE);
+        h.fileLen = crashLength(file, CRASH_FILE_SIZE);
+        h.functionLen = crashLength(function, CRASH_FUNC_SIZE);
+        h.formatLen = args ? crashLength(args->data, CRASH_FORMAT_SIZE) : 0;
+        h.argsSize = args ? args->size - args->fmtSize : 0;
+        h.fieldsSize = fields ? fields->size : 0;
+        h.messageLen = std::min(msgLen, (unsigned int)CRASH_MESSAGE_SIZE - 1);
+        unsigned int size = CRASH_ALIGN(sizeof(h) + h.categoryLen + 1 + h.fileLen + 1
+                                        + h.functionLen + 1 + h.formatLen + 1
+                                        + h.argsSize + h.fieldsSize + h.messageLen + 1);
+        h.size = size;
+        qi::os::timeval date;
+        detail::wallClock(timestamp, &date);
+        h.seconds = date.tv_sec;
+        h.microseconds = date.tv_usec;
+
+        // the chunk of the thread is given up when full, or when the
+        // other threads are about to overwrite it
+        boost::uint64_t ringSize = ring->header->size;
+        unsigned int chunkSize = (unsigned int)std::min(ringSize / 16,
+                                                        (boost::uint64_t)CRASH_CHUNK_SIZE);
+        boost::uint64_t head;
+        if (size > chunkSize)
+        {
+          head = crashReserve(ring, size);
+        }
+        else
+        {
+          CrashChunk *chunk = _glCrashChunk.get();
+          if (!chunk)
+          {
+            chunk = new CrashChunk;
+            chunk->ring = 0;
+            _glCrashChunk.reset(chunk);
+          }
+          if (chunk->ring != ring || chunk->end - chunk->pos < size ||
+              ring->head()->load(boost::memory_order_relaxed) + chunkSize
+              > chunk->end - chunkSize + ringSize)
+          {
+            chunk->ring = ring;
+            chunk->pos = crashReserve(ring, chunkSize);
+            chunk->end = chunk->pos + chunkSize;
+          }
+          head = chunk->pos;
+          chunk->pos += size;
+        }
+
+        char *dst = ring->data + (head & (ringSize - 1));
+        CrashRecordHeader *record = reinterpret_cast<CrashRecordHeader*>(dst);
+        h.commit = 0;
+        memcpy(record, &h, sizeof(h));
+        char *p = dst + sizeof(h);
+        p = crashCopy(p, category, h.categoryLen);
+        p = crashCopy(p, file, h.fileLen);
+        p = crashCopy(p, function, h.functionLen);
+        p = crashCopy(p, args ? args->data : "", h.formatLen);
+        if (args)
+          memcpy(p, args->data + args->fmtSize, h.argsSize);
+        p += h.argsSize;
+        if (fields)
+          memcpy(p, fields->data, h.fieldsSize);
+        p += h.fieldsSize;
+        crashCopy(p, msg, h.messageLen);
+        boost::atomic_thread_fence(boost::memory_order_release);
+        record->commit = (boost::uint32_t)(head / 8 + 1);
+      }
+    }
+
+    std::string setCrashRing(unsigned int bytes, const std::string &path)
+    {
+      if (!bytes)
+      {
+        _glCrashRing.store(0, boost::memory_order_release);
+        return std::string();
+      }
+
+      unsigned int size = 16 * 1024;
+      while (size < bytes && size < 64 * 1024 * 1024)
+        size *= 2;
+
+      std::string file = path;
+      if (file.empty())
+      {
+        std::stringstream ss;
+        ss << "qilog-" << qi::os::getpid() << ".ring";
+        file = (boost::filesystem::path(qi::os::tmp()) / ss.str()).string();
+      }
+
+      CrashRing *ring = 0;
+      try
+      {
+        {
+          std::ofstream create(file.c_str(), std::ios::binary | std::ios::trunc);
+          if (!create)
+            return std::string();
+        }
+        boost::filesystem::resize_file(file, sizeof(CrashRingHeader) + size);
+        ring = new CrashRing(file, size);
+      }
+      catch (const std::exception &e)
+      {
+        qiLogError("qi.log", "cannot map the crash ring %s: %s", file.c_str(), e.what());
+        return std::string();
+      }
+
+      boost::mutex::scoped_lock l(_glCrashRingsLock);
+      _glCrashRings.push_back(ring);
+      _glCrashRing.store(ring, boost::memory_order_release);
+      return file;
+    }
+
+    struct CrashText
+    {
+      char      padded[CAT_PADDED + 1];
+      char      message[CRASH_MESSAGE_SIZE];
+      LogField  fields[detail::LogFields::maxCount];
+    };
+
+    // Whether a committed record of the ring starts at pos.
+    static const CrashRecordHeader *crashRecordAt(const char      *data,
+                                                  boost::uint64_t  size,
+                                                  boost::uint64_t  pos)
+    {
+      boost::uint64_t left = size - (pos & (size - 1));
+      if (left < sizeof(CrashRecordHeader))
+        return 0;
+      const CrashRecordHeader *h =
+        reinterpret_cast<const CrashRecordHeader*>(data + (pos & (size - 1)));
+      if (h->commit != (boost::uint32_t)(pos / 8 + 1) ||
+          h->size < sizeof(CrashRecordHeader) || h->size % 8 || h->size > left)
+        return 0;
+      if (h->level == CRASH_PADDING)
+        return h;
+      unsigned int used = sizeof(CrashRecordHeader) + h->categoryLen + 1 + h->fileLen + 1
+        + h->functionLen + 1 + h->formatLen + 1 + h->argsSize + h->fieldsSize + h->messageLen + 1;
+      if (used > h->size || h->level > debug)
+        return 0;
+      return h;
+    }
+
+    static void crashToRecord(const CrashRecordHeader *h, CrashText *text, LogRecord *record)
+    {
+      const char *category = reinterpret_cast<const char*>(h) + sizeof(CrashRecordHeader);
+      const char *file = category + h->categoryLen + 1;
+      const char *function = file + h->fileLen + 1;
+      const char *format = function + h->functionLen + 1;
+      const char *args = format + h->formatLen + 1;
+      const char *fields = args + h->argsSize;
+      const char *message = fields + h->fieldsSize;
+
+      record->level = (LogLevel)h->level;
+      record->timestamp = h->timestamp;
+      record->date.tv_sec = (long)h->seconds;
+      record->date.tv_usec = h->microseconds;
+      record->category = category;
+      detail::padCategory(category, text->padded);
+      record->paddedCategory = text->padded;
+      record->file = file;
+      record->function = function;
+      record->line = h->line;
+      record->message = message;
+      if (h->formatLen)
+      {
+        int len = detail::formatArgs(format, args, h->argsSize,
+                                     text->message, CRASH_MESSAGE_SIZE);
+        strncpy(text->message + len, message, CRASH_MESSAGE_SIZE - len - 1);
+        text->message[CRASH_MESSAGE_SIZE - 1] = '\0';
+        record->message = text->message;
+      }
+      record->fields = text->fields;
+      record->fieldCount = h->fieldsSize ?
+        detail::decodeFields(fields, h->fieldsSize, text->fields) : 0;
+    }
+
+    static bool crashOlder(const CrashRecordHeader *a, const CrashRecordHeader *b)
+    {
+      return a->timestamp < b->timestamp;
+    }
+
+    bool readCrashRing(const std::string &path, logBatchFuncHandler fct, unsigned int last)
+    {
+      std::ifstream in(path.c_str(), std::ios::binary);
+      if (!in)
+        return false;
+      std::vector<char> content((std::istreambuf_iterator<char>(in)),
+                                std::istreambuf_iterator<char>());
+      if (content.size() < sizeof(CrashRingHeader))
+        return false;
+      CrashRingHeader header;
+      memcpy(&header, &content[0], sizeof(header));
+      if (memcmp(header.magic, CRASH_MAGIC, sizeof(header.magic)) != 0 ||
+          header.size == 0 || (header.size & (header.size - 1)) ||
+          content.size() < header.headerSize + header.size)
+        return false;
+
+      const char *data = &content[0] + header.headerSize;
+      boost::uint64_t head = header.head;
+      boost::uint64_t pos = head > header.size ? head - header.size : 0;
+      std::vector<const CrashRecordHeader*> records;
+      while (pos < head)
+      {
+        const CrashRecordHeader *h = crashRecordAt(data, header.size, pos);
+        if (!h)
+        {
+          // torn or overwritten, look for the next record
+          pos += 8;
+          continue;
+        }
+        if (h->level != CRASH_PADDING)
+          records.push_back(h);
+        pos += h->size;
+      }
+      // the chunks of the threads interleave
+      std::stable_sort(records.begin(), records.end(), crashOlder);
+
+      unsigned int first = last && records.size() > last ? records.size() - last : 0;
+      std::vector<CrashText> text(CRASH_BATCH);
+      LogRecord batch[CRASH_BATCH];
+      unsigned int count = 0;
+      for (unsigned int i = first; i < records.size(); ++i)
+      {
+        crashToRecord(records[i], &text[count], &batch[count]);
+        if (++count == CRASH_BATCH || i + 1 == records.size())
+        {
+          fct(batch, count);
+          count = 0;
+        }
+      }
+      return true;
+    }
+
+  } // namespace log
+} // namespace qi
@@ -0,0 +1,33 @@
+/*
+ * Copyright (c) 2012 Aldebaran Robotics. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the COPYING file.
+ */
+
+#ifndef   	LOGCRASH_HPP_
+# define   	LOGCRASH_HPP_
+
+# include <boost/cstdint.hpp>
+# include <qi/log.hpp>
+
+namespace qi {
+  namespace log {
+    namespace detail {
+      // Copy a record in the crash ring set by setCrashRing, if any.
+      // Strings are truncated, the deferred arguments and the fields are
+      // copied as is.
+      void crashRecord(LogLevel         verb,
+                       boost::uint64_t  timestamp,
+                       const char      *category,
+                       const char      *file,
+                       const char      *function,
+                       int              line,
+                       const LogArgs   *args,
+                       const LogFields *fields,
+                       const char      *msg,
+                       unsigned int     msgLen);
+    }
+  }
+} // namespace qi::log::detail
+
+#endif	    /* !LOGCRASH_HPP_ */
@@ -0,0 +1,198 @@
+/*
+ * Copyright (c) 2012 Aldebaran Robotics. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the COPYING file.
+ */
+
+#include <qi/log.hpp>
+#include "logfields.hpp"
+#include "logoutput.hpp"
+
+#include <cstring>
+#include <cstdio>
+
+#ifdef _MSC_VER
+# define snprintf _snprintf
+#endif
+
+// Longest key and string value, longer ones are truncated.
+#define FIELD_KEY_SIZE 64
+#define FIELD_STRING_SIZE 256
+
+namespace qi {
+  namespace log {
+    namespace detail {
+
+      /*
+       * A field is its type, the length of its key and of its value, the
+       * key and the value. Numbers take 8 bytes, strings are '\0'
+       * terminated. Nothing is aligned, values are read with memcpy.
+       */
+      struct FieldHeader
+      {
+        unsigned char   type;
+        unsigned char   keyLen;
+        unsigned short  valueLen;
+      };
+
+      void addField(LogFields *fields, const char *key, const LogField &field)
+      {
+        if (fields->count >= LogFields::maxCount)
+          return;
+        if (!key)
+          key = "(null)";
+        const char *str = field.value.s;
+        if (field.type == stringField && !str)
+          str = "(null)";
+
+        FieldHeader h;
+        h.type = field.type;
+        h.keyLen = boundedLength(key, FIELD_KEY_SIZE - 1);
+        h.valueLen = field.type == stringField ?
+          boundedLength(str, FIELD_STRING_SIZE - 1) + 1 : 8;
+        unsigned int size = sizeof(h) + h.keyLen + 1 + h.valueLen;
+        if (fields->size + size > LogFields::capacity)
+          return;
+
+        char *p = fields->data + fields->size;
+        memcpy(p, &h, sizeof(h));
+        p += sizeof(h);
+        memcpy(p, key, h.keyLen);
+        p[h.keyLen] = '\0';
+        p += h.keyLen + 1;
+        if (field.type == stringField)
+        {
+          memcpy(p, str, h.valueLen - 1);
+          p[h.valueLen - 1] = '\0';
+        }
+        else if (field.type == doubleField)
+          memcpy(p, &field.value.d, 8);
+        else if (field.type == boolField)
+        {
+          boost::uint64_t b = field.value.b;
+          memcpy(p, &b, 8);
+        }
+        else
+          memcpy(p, &field.value.u, 8);
+        fields->size += size;
+        ++fields->count;
+      }
+
+      unsigned int decodeFields(const char   *data,
+                                unsigned int  size,
+                                LogField     *fields)
+      {
+        unsigned int count = 0;
+        const char *p = data;
+        const char *end = data + size;
+        while (p < end && count < LogFields::maxCount)
+        {
+          // the data may come from a damaged crash ring: stop on what
+          // does not fit or is not terminated
+          FieldHeader h;
+          if ((unsigned int)(end - p) < sizeof(h))
+            break;
+          memcpy(&h, p, sizeof(h));
+          p += sizeof(h);
+          if ((unsigned int)(end - p) < h.keyLen + 1u + h.valueLen || p[h.keyLen] != '\0')
+            break;
+          const char *value = p + h.keyLen + 1;
+          if (h.type > stringField ||
+              (h.type == stringField ? !h.valueLen || value[h.valueLen - 1] != '\0' :
+               h.valueLen != 8))
+            break;
+          LogField &field = fields[count++];
+          field.key = p;
+          field.type = (LogFieldType)h.type;
+          p = value;
+          if (field.type == stringField)
+            field.value.s = p;
+          else if (field.type == doubleField)
+            memcpy(&field.value.d, p, 8);
+          else if (field.type == boolField)
+          {
+            boost::uint64_t b;
+            memcpy(&b, p, 8);
+            field.value.b = b != 0;
+          }
+          else
+            memcpy(&field.value.u, p, 8);
+          p += h.valueLen;
+        }
+        return count;
+      }
+
+      // Strings with spaces, quotes or '=' are quoted. Like snprintf,
+      // return len or more when it does not fit.
+      static int formatString(char *buf, unsigned int len, const char *str)
+      {
+        if (!strpbrk(str, " \t\"=") && *str)
+          return snprintf(buf, len, "%s", str);
+
+        unsigned int n = 0;
+        buf[n++] = '"';
+        for (const char *s = str; *s; ++s)
+        {
+          if (n + 3 >= len)
+            return len;
+          if (*s == '"' || *s == '\\')
+            buf[n++] = '\\';
+          buf[n++] = *s;
+        }
+        if (n + 1 >= len)
+          return len;
+        buf[n++] = '"';
+        buf[n] = '\0';
+        return n;
+      }
+    }
+
+    // Render the fields as " key=value" pairs in buffer, always null
+    // terminated. Return the length written.
+    unsigned int formatFields(const LogRecord &record, char *buffer, unsigned int size)
+    {
+      if (!size)
+        return 0;
+      unsigned int len = 0;
+      buffer[0] = '\0';
+      for (unsigned int i = 0; i < record.fieldCount && len + 1 < size; ++i)
+      {
+        const LogField &field = record.fields[i];
+        unsigned int start = len;
+        int n = snprintf(buffer + len, size - len, " %s=", field.key);
+        if (n < 0 || len + n >= size)
+          break;
+        len += n;
+        switch (field.type)
+        {
+        case intField:
+          n = snprintf(buffer + len, size - len, "%lld", (long long)field.value.i);
+          break;
+        case uintField:
+          n = snprintf(buffer + len, size - len, "%llu", (unsigned long long)field.value.u);
+          break;
+        case doubleField:
+          n = snprintf(buffer + len, size - len, "%g", field.value.d);
+          break;
+        case boolField:
+          n = snprintf(buffer + len, size - len, "%s", field.value.b ? "true" : "false");
+          break;
+        case stringField:
+        default:
+          n = detail::formatString(buffer + len, size - len, field.value.s);
+          break;
+        }
+        if (n < 0 || len + n >= size)
+        {
+          len = start;
+          break;
+        }
+        len += n;
+      }
+      // a truncated field is cut out
+      buffer[len] = '\0';
+      return len;
+    }
+
+  } // namespace log
+} // namespace qi
@@ -0,0 +1,25 @@
+/*
+ * Copyright (c) 2012 Aldebaran Robotics. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the COPYING file.
+ */
+
+#ifndef   	LOGFIELDS_HPP_
+# define   	LOGFIELDS_HPP_
+
+# include <qi/log.hpp>
+
+namespace qi {
+  namespace log {
+    namespace detail {
+      // Decode the fields copied by addField, the keys and strings point
+      // into data. Return the number of fields, the ones before the first
+      // malformed one.
+      unsigned int decodeFields(const char   *data,
+                                unsigned int  size,
+                                LogField     *fields);
+    }
+  }
+} // namespace qi::log::detail
+
+#endif	    /* !LOGFIELDS_HPP_ */
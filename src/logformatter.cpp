@@ -0,0 +1,371 @@
+/*
+ * Copyright (c) 2012 Aldebaran Robotics. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the COPYING file.
+ */
+
+#include <qi/log/logformatter.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <boost/atomic.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "logoutput.hpp"
+
+namespace qi {
+  namespace log {
+
+    enum LogFormatterOpType
+    {
+      literalOp = 0,
+      levelOp,
+      categoryOp,
+      fullCategoryOp,
+      dateOp,
+      fileOp,
+      lineOp,
+      functionOp,
+      messageOp
+    };
+
+    struct LogFormatterOp
+    {
+      LogFormatterOpType type;
+      // literal text, in the literals of the program
+      unsigned int       offset;
+      unsigned int       length;
+    };
+
+    // A compiled pattern. Never changed once published: the handlers of
+    // synchronous logs format from several threads.
+    struct LogFormatterProgram
+    {
+      std::string                  literals;
+      std::vector<LogFormatterOp>  ops;
+      // what it was compiled from, when following the global layout
+      unsigned int                 version;
+      int                          context;
+    };
+
+    class PrivateLogFormatter
+    {
+    public:
+      LogFormatterProgram *compile(const std::string &pattern);
+      const LogFormatterProgram *program();
+
+      // set for the formatters following setLogPattern and the context
+      bool                               global;
+      boost::mutex                       lock;
+      boost::atomic<LogFormatterProgram*> current;
+      // the previous programs may still be in use, freed with the formatter
+      std::vector<LogFormatterProgram*>  programs;
+    };
+
+    static boost::mutex                 _glPatternLock;
+    static std::string                  _glPattern;
+    static boost::atomic<unsigned int>  _glPatternVersion;
+
+    // Layout of each context, see qi::log::setContext.
+    static const char *contextPatterns[] = {
+      "%L %m",
+      "%L %c: %m",
+      "%L %t %m",
+      "%L %f(%l) %m",
+      "%L %t %c: %m",
+      "%L %t %f(%l) %m",
+      "%L %c: %f(%l) %m",
+      "%L %t %c: %f(%l) %F %m"
+    };
+
+    static const char *contextPattern(int ctx)
+    {
+      if (ctx < 0 || ctx > 7)
+        ctx = 0;
+      return contextPatterns[ctx];
+    }
+
+    LogFormatterProgram *PrivateLogFormatter::compile(const std::string &pattern)
+    {
+      LogFormatterProgram *program = new LogFormatterProgram;
+      const char *p = pattern.c_str();
+      while (*p)
+      {
+        LogFormatterOp op;
+        op.type = literalOp;
+        op.offset = 0;
+        op.length = 0;
+        if (*p == '%' && p[1])
+        {
+          switch (p[1])
+          {
+          case 'L': op.type = levelOp; break;
+          case 'c': op.type = categoryOp; break;
+          case 'C': op.type = fullCategoryOp; break;
+          case 't': op.type = dateOp; break;
+          case 'f': op.type = fileOp; break;
+          case 'l': op.type = lineOp; break;
+          case 'F': op.type = functionOp; break;
+          case 'm': op.type = messageOp; break;
+          default:
+            // %% and the unknown ones give the character
+            op.offset = program->literals.size();
+            op.length = 1;
+            program->literals += p[1];
+            break;
+          }
+          p += 2;
+        }
+        else
+        {
+          const char *end = p + 1;
+          while (*end && *end != '%')
+            ++end;
+          op.offset = program->literals.size();
+          op.length = end - p;
+          program->literals.append(p, end - p);
+          p = end;
+        }
+
+        // merge the consecutive literals
+        if (op.type == literalOp && !program->ops.empty() &&
+            program->ops.back().type == literalOp)
+          program->ops.back().length += op.length;
+        else
+          program->ops.push_back(op);
+      }
+      return program;
+    }
+
+    // The program to use, compiled again if the layout changed.
+    const LogFormatterProgram *PrivateLogFormatter::program()
+    {
+      LogFormatterProgram *program = current.load(boost::memory_order_acquire);
+      if (!global)
+        return program;
+      unsigned int version = _glPatternVersion.load(boost::memory_order_acquire);
+      int ctx = qi::log::context();
+      if (program && program->version == version && program->context == ctx)
+        return program;
+
+      boost::mutex::scoped_lock l(lock);
+      program = current.load(boost::memory_order_acquire);
+      if (program && program->version == version && program->context == ctx)
+        return program;
+      std::string pattern;
+      {
+        boost::mutex::scoped_lock p(_glPatternLock);
+        pattern = _glPattern;
+      }
+      program = compile(pattern.empty() ? contextPattern(ctx) : pattern);
+      program->version = version;
+      program->context = ctx;
+      programs.push_back(program);
+      current.store(program, boost::memory_order_release);
+      return program;
+    }
+
+    static char *appendString(char *p, char *end, const char *str)
+    {
+      while (p < end && *str)
+        *p++ = *str++;
+      return p;
+    }
+
+    static char *appendBytes(char *p, char *end, const char *bytes, unsigned int length)
+    {
+      unsigned int n = std::min((unsigned int)(end - p), length);
+      memcpy(p, bytes, n);
+      return p + n;
+    }
+
+    // width: minimum number of digits, padded with 0
+    static char *appendUnsigned(char *p, char *end, unsigned long value, int width)
+    {
+      char digits[24];
+      int n = 0;
+      do
+      {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+      }
+      while (value);
+      while (n < width)
+        digits[n++] = '0';
+      while (n && p < end)
+        *p++ = digits[--n];
+      return p;
+    }
+
+    static char *appendInt(char *p, char *end, long value)
+    {
+      if (value >= 0)
+        return appendUnsigned(p, end, value, 1);
+      if (p < end)
+        *p++ = '-';
+      return appendUnsigned(p, end, -(unsigned long)value, 1);
+    }
+
+    // The records come with their category padded already.
+    static char *appendCategory(char *p, char *end, const char *category,
+                                const LogRecord *record)
+    {
+      if (record && record->paddedCategory)
+        return appendBytes(p, end, record->paddedCategory, CAT_PADDED);
+      char padded[CAT_PADDED + 1];
+      detail::padCategory(category, padded);
+      return appendBytes(p, end, padded, CAT_PADDED);
+    }
+
+    LogFormatter::LogFormatter()
+      : _private(new PrivateLogFormatter)
+    {
+      _private->global = true;
+      _private->current.store(0);
+    }
+
+    LogFormatter::LogFormatter(const std::string& pattern)
+      : _private(new PrivateLogFormatter)
+    {
+      _private->global = false;
+      LogFormatterProgram *program = _private->compile(pattern);
+      _private->programs.push_back(program);
+      _private->current.store(program);
+    }
+
+    LogFormatter::~LogFormatter()
+    {
+      for (unsigned int i = 0; i < _private->programs.size(); ++i)
+        delete _private->programs[i];
+      delete _private;
+    }
+
+    // The fields of record, if any, go between the message and its newline.
+    static char *appendMessage(char *p, char *end, const char *msg, const LogRecord *record)
+    {
+      if (!record || !record->fieldCount)
+        return appendString(p, end, msg);
+      unsigned int len = strlen(msg);
+      unsigned int text = len;
+      while (text && (msg[text - 1] == '\n' || msg[text - 1] == '\r'))
+        --text;
+      char *start = p;
+      p = appendBytes(p, end, msg, text);
+      // formatFields null terminates, end has room for it
+      unsigned int n = formatFields(*record, p, end - p + 1);
+      // no leading space when there is no text
+      if (p == start && n)
+      {
+        memmove(p, p + 1, n);
+        --n;
+      }
+      p += n;
+      return appendBytes(p, end, msg + text, len - text);
+    }
+
+    static unsigned int render(const LogFormatterProgram *program,
+                               char                      *buffer,
+                               unsigned int               size,
+                               const qi::log::LogLevel    verb,
+                               const qi::os::timeval     &date,
+                               const char                *category,
+                               const char                *msg,
+                               const char                *file,
+                               const char                *fct,
+                               const int                  line,
+                               const LogRecord           *record,
+                               unsigned int              *levelBegin,
+                               unsigned int              *levelEnd)
+    {
+      if (!size)
+        return 0;
+      char *p = buffer;
+      char *end = buffer + size - 1;
+      if (levelBegin)
+        *levelBegin = 0;
+      if (levelEnd)
+        *levelEnd = 0;
+      for (unsigned int i = 0; i < program->ops.size(); ++i)
+      {
+        const LogFormatterOp &op = program->ops[i];
+        switch (op.type)
+        {
+        case literalOp:
+          p = appendBytes(p, end, program->literals.data() + op.offset, op.length);
+          break;
+        case levelOp:
+          if (levelBegin)
+            *levelBegin = p - buffer;
+          p = appendString(p, end, logLevelToString(verb));
+          if (levelEnd)
+            *levelEnd = p - buffer;
+          break;
+        case categoryOp:
+          p = appendCategory(p, end, category ? category : "(null)", record);
+          break;
+        case fullCategoryOp:
+          p = appendString(p, end, category ? category : "(null)");
+          break;
+        case dateOp:
+          p = appendInt(p, end, date.tv_sec);
+          if (p < end)
+            *p++ = '.';
+          p = appendUnsigned(p, end, date.tv_usec, 6);
+          break;
+        case fileOp:
+          p = appendString(p, end, file ? file : "(null)");
+          break;
+        case lineOp:
+          p = appendInt(p, end, line);
+          break;
+        case functionOp:
+          p = appendString(p, end, fct ? fct : "(null)");
+          break;
+        case messageOp:
+          p = appendMessage(p, end, msg ? msg : "(null)", record);
+          break;
+        }
+      }
+      *p = '\0';
+      return p - buffer;
+    }
+
+    unsigned int LogFormatter::format(char                    *buffer,
+                                      unsigned int             size,
+                                      const qi::log::LogLevel  verb,
+                                      const qi::os::timeval    date,
+                                      const char              *category,
+                                      const char              *msg,
+                                      const char              *file,
+                                      const char              *fct,
+                                      const int                line,
+                                      unsigned int            *levelBegin,
+                                      unsigned int            *levelEnd)
+    {
+      return render(_private->program(), buffer, size, verb, date, category, msg,
+                    file, fct, line, 0, levelBegin, levelEnd);
+    }
+
+    unsigned int LogFormatter::format(char                     *buffer,
+                                      unsigned int              size,
+                                      const qi::log::LogRecord &record,
+                                      unsigned int             *levelBegin,
+                                      unsigned int             *levelEnd)
+    {
+      return render(_private->program(), buffer, size, record.level, record.date,
+                    record.category, record.message, record.file, record.function,
+                    record.line, &record, levelBegin, levelEnd);
+    }
+
+    void setLogPattern(const std::string &pattern)
+    {
+      boost::mutex::scoped_lock l(_glPatternLock);
+      _glPattern = pattern;
+      _glPatternVersion.fetch_add(1, boost::memory_order_release);
+    }
+
+  } // namespace log
+} // namespace qi
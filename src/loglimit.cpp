@@ -0,0 +1,175 @@
+/*
+ * Copyright (c) 2012 Aldebaran Robotics. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the COPYING file.
+ */
+
+#include <qi/log.hpp>
+#include "loglimit.hpp"
+
+#include <algorithm>
+
+namespace qi {
+  namespace log {
+
+    // nanoseconds between two records once the burst is spent, 0 for none
+    static boost::uint64_t                _glRateInterval[debug + 1];
+    static unsigned int                   _glRateBurst[debug + 1];
+    static bool                           _glCollapseRepeats[debug + 1];
+    static boost::atomic<unsigned long>   _glSuppressed(0);
+    static boost::atomic<bool>            _glReportPending(false);
+    static boost::atomic<detail::Throttle*> _glThrottles(0);
+
+    namespace detail {
+      bool throttledLevel[debug + 1];
+
+      Throttle *newThrottle(const Category *category, const CallSite *site)
+      {
+        Throttle *t = new Throttle;
+        t->category = category;
+        t->site = site;
+        t->arrival.store(0);
+        t->lastHash.store(0);
+        t->lastTime.store(0);
+        t->repeated.store(0);
+        t->limited.store(0);
+        t->level.store(silent);
+        t->lastReport.store(0);
+        // only inserted under the table lock, readers just follow next
+        t->next = _glThrottles.load(boost::memory_order_relaxed);
+        _glThrottles.store(t, boost::memory_order_release);
+        return t;
+      }
+
+      Throttle *throttles()
+      {
+        return _glThrottles.load(boost::memory_order_acquire);
+      }
+
+      // FNV-1a of the message, of its deferred arguments and of its fields.
+      static boost::uint64_t messageHash(const char      *msg,
+                                         const LogArgs   *args,
+                                         const LogFields *fields)
+      {
+        boost::uint64_t h = 14695981039346656037ULL;
+        for (const unsigned char *p = (const unsigned char*)msg; *p; ++p)
+          h = (h ^ *p) * 1099511628211ULL;
+        if (args)
+        {
+          for (unsigned int i = 0; i < args->size; ++i)
+            h = (h ^ (unsigned char)args->data[i]) * 1099511628211ULL;
+        }
+        if (fields)
+        {
+          for (unsigned int i = 0; i < fields->size; ++i)
+            h = (h ^ (unsigned char)fields->data[i]) * 1099511628211ULL;
+        }
+        return h;
+      }
+
+      static bool suppress(Throttle                     *t,
+                           boost::atomic<unsigned long> &counter,
+                           LogLevel                      verb)
+      {
+        counter.fetch_add(1, boost::memory_order_relaxed);
+        t->level.store(verb, boost::memory_order_relaxed);
+        _glSuppressed.fetch_add(1, boost::memory_order_relaxed);
+        _glReportPending.store(true, boost::memory_order_release);
+        return false;
+      }
+
+      bool admit(Throttle        *t,
+                 LogLevel         verb,
+                 const char      *msg,
+                 const LogArgs   *args,
+                 const LogFields *fields,
+                 boost::uint64_t  now)
+      {
+        boost::uint64_t hash = 0;
+        if (_glCollapseRepeats[verb])
+        {
+          hash = messageHash(msg, args, fields);
+          if (hash == t->lastHash.load(boost::memory_order_relaxed) &&
+              now - t->lastTime.load(boost::memory_order_relaxed) < RTLOG_REPORT_INTERVAL)
+            return suppress(t, t->repeated, verb);
+        }
+
+        boost::uint64_t interval = _glRateInterval[verb];
+        if (interval)
+        {
+          // the burst is the number of intervals arrival may run ahead of now
+          boost::uint64_t tolerance = interval * (_glRateBurst[verb] - 1);
+          boost::uint64_t arrival = t->arrival.load(boost::memory_order_relaxed);
+          boost::uint64_t start;
+          do
+          {
+            start = std::max(arrival, now);
+            if (start - now > tolerance)
+              return suppress(t, t->limited, verb);
+          }
+          while (!t->arrival.compare_exchange_weak(arrival, start + interval,
+                                                   boost::memory_order_relaxed));
+        }
+
+        t->lastHash.store(hash, boost::memory_order_relaxed);
+        t->lastTime.store(now, boost::memory_order_relaxed);
+        return true;
+      }
+
+      bool takeReport(Throttle        *t,
+                      boost::uint64_t  now,
+                      bool             repeats,
+                      bool             force,
+                      unsigned long   *repeated,
+                      unsigned long   *limited)
+      {
+        bool due = force
+          || now - t->lastReport.load(boost::memory_order_relaxed) >= RTLOG_REPORT_INTERVAL;
+        *repeated = 0;
+        *limited = 0;
+        if (due || repeats)
+          *repeated = t->repeated.exchange(0, boost::memory_order_relaxed);
+        if (due)
+          *limited = t->limited.exchange(0, boost::memory_order_relaxed);
+        if (*repeated || *limited)
+          t->lastReport.store(now, boost::memory_order_relaxed);
+        // left for a later report
+        if (t->repeated.load(boost::memory_order_relaxed) ||
+            t->limited.load(boost::memory_order_relaxed))
+          _glReportPending.store(true, boost::memory_order_release);
+        return *repeated || *limited;
+      }
+
+      bool takeReportPending()
+      {
+        if (!_glReportPending.load(boost::memory_order_relaxed))
+          return false;
+        return _glReportPending.exchange(false, boost::memory_order_acquire);
+      }
+    }
+
+    static void updateThrottledLevel(const LogLevel verb)
+    {
+      detail::throttledLevel[verb] = _glRateInterval[verb] || _glCollapseRepeats[verb];
+    }
+
+    void setRateLimit(const LogLevel verb, unsigned int rate, unsigned int burst)
+    {
+      _glRateInterval[verb] = rate ? 1000000000ULL / rate : 0;
+      _glRateBurst[verb] = burst ? burst : 1;
+      updateThrottledLevel(verb);
+    }
+
+    void setRepeatSuppression(const LogLevel verb, bool collapse)
+    {
+      _glCollapseRepeats[verb] = collapse;
+      updateThrottledLevel(verb);
+    }
+
+    unsigned long suppressedLogs()
+    {
+      return _glSuppressed.load(boost::memory_order_relaxed);
+    }
+
+  } // namespace log
+} // namespace qi
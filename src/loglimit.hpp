@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2012 Aldebaran Robotics. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the COPYING file.
+ */
+
+#ifndef   	LOGLIMIT_HPP_
+# define   	LOGLIMIT_HPP_
+
+# include <boost/cstdint.hpp>
+# include <boost/atomic.hpp>
+# include <qi/log.hpp>
+
+// Interval between two reports of the suppressed records of a call site,
+// in nanoseconds. Repeated messages only collapse within it.
+# define RTLOG_REPORT_INTERVAL 1000000000ULL
+
+namespace qi {
+  namespace log {
+    namespace detail {
+      // Rate limit and repeat state of a call site, or of a category for
+      // the logs without call site. Never freed.
+      struct Throttle
+      {
+        const Category *category;
+        const CallSite *site;
+        // generic cell rate algorithm: earliest time of the next record
+        // once the burst is spent
+        boost::atomic<boost::uint64_t> arrival;
+        // hash and time of the last message let through
+        boost::atomic<boost::uint64_t> lastHash;
+        boost::atomic<boost::uint64_t> lastTime;
+        // suppressed since the last report, and their level
+        boost::atomic<unsigned long>   repeated;
+        boost::atomic<unsigned long>   limited;
+        boost::atomic<int>             level;
+        boost::atomic<boost::uint64_t> lastReport;
+        // next throttle in creation order, see throttles()
+        Throttle                      *next;
+      };
+
+      // Set for the levels with a rate limit or repeat suppression.
+      extern bool throttledLevel[debug + 1];
+
+      // Must be called with the category table lock held.
+      Throttle *newThrottle(const Category *category, const CallSite *site);
+
+      // Every throttle created so far.
+      Throttle *throttles();
+
+      // Whether a record of the message, logged at now, may go through.
+      // Otherwise it is counted in the throttle until the next report.
+      bool admit(Throttle        *throttle,
+                 LogLevel         verb,
+                 const char      *msg,
+                 const LogArgs   *args,
+                 const LogFields *fields,
+                 boost::uint64_t  now);
+
+      // Take the suppressed counts to report at now: the rate limited ones
+      // once per interval, the repeats also before a message goes through
+      // (repeats). force reports everything. False if there is none.
+      bool takeReport(Throttle        *throttle,
+                      boost::uint64_t  now,
+                      bool             repeats,
+                      bool             force,
+                      unsigned long   *repeated,
+                      unsigned long   *limited);
+
+      // Whether a throttle may have counts left to report. Cleared, the
+      // throttles not reported by takeReport set it again.
+      bool takeReportPending();
+    }
+  }
+} // namespace qi::log::detail
+
+#endif	    /* !LOGLIMIT_HPP_ */
@@ -0,0 +1,120 @@
+/*
+ * Copyright (c) 2012 Aldebaran Robotics. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the COPYING file.
+ */
+
+#include "logoutput.hpp"
+
+#include <cstring>
+
+#include <boost/thread/tss.hpp>
+
+#ifdef _WIN32
+# include <io.h>
+#else
+# include <errno.h>
+# include <unistd.h>
+# include <sys/uio.h>
+#endif
+
+namespace qi {
+  namespace log {
+    namespace detail {
+
+      struct LineBuffer
+      {
+        char data[LINESIZEMAX];
+      };
+
+      static boost::thread_specific_ptr<LineBuffer> _glLineBuffer;
+
+      char *lineBuffer()
+      {
+        LineBuffer *line = _glLineBuffer.get();
+        if (!line)
+        {
+          line = new LineBuffer;
+          _glLineBuffer.reset(line);
+        }
+        return line->data;
+      }
+
+      unsigned int boundedLength(const char *str, unsigned int max)
+      {
+        unsigned int len = 0;
+        while (len < max && str[len])
+          ++len;
+        return len;
+      }
+
+      void padCategory(const char *name, char *padded)
+      {
+        unsigned int size = strlen(name);
+        if (size <= CAT_PADDED)
+        {
+          memset(padded, ' ', CAT_PADDED);
+          memcpy(padded, name, size);
+        }
+        else
+        {
+          memset(padded, '.', 3);
+          memcpy(padded + 3, name + size - CAT_PADDED + 3, CAT_PADDED - 3);
+        }
+        padded[CAT_PADDED] = '\0';
+      }
+
+      bool writeAll(int fd, const char *data, unsigned int size)
+      {
+        while (size)
+        {
+#ifdef _WIN32
+          int n = ::_write(fd, data, size);
+          if (n < 0)
+            return false;
+#else
+          ssize_t n = ::write(fd, data, size);
+          if (n < 0)
+          {
+            if (errno == EINTR)
+              continue;
+            return false;
+          }
+#endif
+          data += n;
+          size -= n;
+        }
+        return true;
+      }
+
+#ifndef _WIN32
+      bool writeAll(int fd, struct iovec *iov, int count)
+      {
+        while (count)
+        {
+          ssize_t n = ::writev(fd, iov, count);
+          if (n < 0)
+          {
+            if (errno == EINTR)
+              continue;
+            return false;
+          }
+          while (count && (size_t)n >= iov->iov_len)
+          {
+            n -= iov->iov_len;
+            ++iov;
+            --count;
+          }
+          if (count)
+          {
+            iov->iov_base = static_cast<char*>(iov->iov_base) + n;
+            iov->iov_len -= n;
+          }
+        }
+        return true;
+      }
+#endif
+
+    }
+  }
+} // namespace qi::log::detail
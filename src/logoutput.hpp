@@ -0,0 +1,45 @@
+/*
+ * Copyright (c) 2012 Aldebaran Robotics. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the COPYING file.
+ */
+
+#ifndef   	LOGOUTPUT_HPP_
+# define   	LOGOUTPUT_HPP_
+
+// Width of the padded category given to the handlers.
+# define CAT_PADDED 16
+// A record message and its context, once formatted.
+# define LINESIZEMAX (17 * 1024)
+
+# ifndef _WIN32
+struct iovec;
+# endif
+
+namespace qi {
+  namespace log {
+    namespace detail {
+      // Length of str, at most max.
+      unsigned int boundedLength(const char *str, unsigned int max);
+
+      // Write the CAT_PADDED characters of the padded category and a
+      // '\0' to padded. Long names keep their end, the most specific part.
+      void padCategory(const char *name, char *padded);
+
+      // LINESIZEMAX bytes of the calling thread, where the handlers format
+      // a line before writing it: the synchronous logs come with the stack
+      // of the caller.
+      char *lineBuffer();
+
+      // Write the data to fd, whatever it takes: interrupted and partial
+      // writes are resumed. Return false on error.
+      bool writeAll(int fd, const char *data, unsigned int size);
+# ifndef _WIN32
+      // Same with several buffers, iov is modified.
+      bool writeAll(int fd, struct iovec *iov, int count);
+# endif
+    }
+  }
+} // namespace qi::log::detail
+
+#endif	    /* !LOGOUTPUT_HPP_ */
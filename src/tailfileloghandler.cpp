@@ -5,38 +5,171 @@
  */
 
 #include <qi/log/tailfileloghandler.hpp>
+#include <qi/log/logformatter.hpp>
+#include "logoutput.hpp"
 
 #include <boost/function.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
 
-#include <sstream>
 #include <string>
 #include <qi/log.hpp>
 #include <qi/os.hpp>
 #include <cstdio>
 
-#define CATSIZEMAX 16
-#define FILESIZEMAX 1024 * 1024
+#ifdef _WIN32
+# include <io.h>
+#else
+# include <errno.h>
+# include <fcntl.h>
+# include <unistd.h>
+#endif
 
 namespace qi {
   namespace log {
     class PrivateTailFileLogHandler
     {
     public:
-      void cutCat(const char* category, char* res);
+      void open(const char *mode);
+      void append(const char *data, unsigned int size);
+      void rotate();
+      void shift();
+      void run();
+      boost::filesystem::path generation(unsigned int i) const;
 
       FILE* _file;
+      int   _fd;
+      LogFormatter _formatter;
       std::string _fileName;
-      int   _writeSize;
+      unsigned long _writeSize;
+      unsigned long _maxSize;
+      // size of the file at which rotate is tried next
+      unsigned long _rotateSize;
+      unsigned int  _generations;
+
+      boost::mutex _lock;
+      // The logging thread renames the file to generation 0 and goes on
+      // in a new one, this thread moves each generation one step older.
+      boost::thread _rotator;
+      boost::condition_variable _rotateCond;
+      bool _shifting;
+      bool _stop;
     };
 
-    TailFileLogHandler::TailFileLogHandler(const std::string& filePath)
+    boost::filesystem::path PrivateTailFileLogHandler::generation(unsigned int i) const
+    {
+      return boost::filesystem::path(_fileName + "." + boost::lexical_cast<std::string>(i));
+    }
+
+    void PrivateTailFileLogHandler::open(const char *mode)
+    {
+      _fd = -1;
+      boost::filesystem::path fPath(_fileName);
+      FILE* file = qi::os::fopen(fPath.make_preferred().string().c_str(), mode);
+      _file = file;
+      if (!file)
+        return;
+      _fd = fileno(file);
+#ifndef _WIN32
+      // each write lands at the end, no seek needed
+      fcntl(_fd, F_SETFL, fcntl(_fd, F_GETFL) | O_APPEND);
+#endif
+    }
+
+    void PrivateTailFileLogHandler::append(const char *data, unsigned int size)
+    {
+      _writeSize += size;
+      detail::writeAll(_fd, data, size);
+    }
+
+    // O(1) on the logging thread, which never waits: a rename and a new
+    // file. While the previous generations are being moved, or when the
+    // rename fails, the lines go on in the current file and rotate is
+    // tried again later. Called with the lock held.
+    void PrivateTailFileLogHandler::rotate()
+    {
+      if (!_generations)
+      {
+        fclose(_file);
+        open("w+");
+        _writeSize = 0;
+        _rotateSize = _maxSize;
+        return;
+      }
+      // the previous rotation must have freed generation 0
+      if (_shifting)
+        return;
+
+      boost::system::error_code ec;
+#ifdef _WIN32
+      // an open file cannot be renamed
+      fclose(_file);
+#endif
+      boost::filesystem::rename(boost::filesystem::path(_fileName), generation(0), ec);
+      if (ec)
+      {
+#ifdef _WIN32
+        open("a+");
+#endif
+        _rotateSize = _writeSize + _maxSize / 8;
+        return;
+      }
+#ifndef _WIN32
+      fclose(_file);
+#endif
+      open("w+");
+      _writeSize = 0;
+      _rotateSize = _maxSize;
+      _shifting = true;
+      _rotateCond.notify_all();
+    }
+
+    void PrivateTailFileLogHandler::shift()
+    {
+      boost::system::error_code ec;
+      boost::filesystem::remove(generation(_generations), ec);
+      for (unsigned int i = _generations; i > 0; --i)
+        boost::filesystem::rename(generation(i - 1), generation(i), ec);
+    }
+
+    void PrivateTailFileLogHandler::run()
+    {
+      boost::mutex::scoped_lock l(_lock);
+      while (true)
+      {
+        while (!_shifting && !_stop)
+          _rotateCond.wait(l);
+        if (_shifting)
+        {
+          l.unlock();
+          shift();
+          l.lock();
+          _shifting = false;
+          _rotateCond.notify_all();
+        }
+        else if (_stop)
+          return;
+      }
+    }
+
+    TailFileLogHandler::TailFileLogHandler(const std::string& filePath,
+                                           unsigned int       maxSize,
+                                           unsigned int       generations)
       : _private(new PrivateTailFileLogHandler)
     {
       _private->_file = NULL;
+      _private->_fd = -1;
       _private->_writeSize = 0;
+      _private->_maxSize = maxSize;
+      _private->_rotateSize = maxSize;
+      _private->_generations = generations;
       _private->_fileName = filePath;
+      _private->_shifting = false;
+      _private->_stop = false;
 
       boost::filesystem::path fPath(_private->_fileName);
       // Create the directory!
@@ -51,38 +184,37 @@ namespace qi {
       }
 
       // Open the file.
-      FILE* file = qi::os::fopen(fPath.make_preferred().string().c_str(), "w+");
+      _private->open("w+");
 
-      if (file)
-        _private->_file = file;
-      else
+      if (_private->_file == NULL)
         qiLogWarning("qi.log.tailfileloghandler") << "Cannot open "
                                                   << filePath << std::endl;
+      else if (generations)
+        _private->_rotator = boost::thread(&PrivateTailFileLogHandler::run, _private);
     }
 
 
-    TailFileLogHandler::~TailFileLogHandler()
+    // Wait until the older generations are in place.
+    void TailFileLogHandler::flush()
     {
-      if (_private->_file != NULL)
-        fclose(_private->_file);
+      boost::mutex::scoped_lock l(_private->_lock);
+      while (_private->_shifting)
+        _private->_rotateCond.wait(l);
     }
 
-    void PrivateTailFileLogHandler::cutCat(const char* category, char* res)
+    TailFileLogHandler::~TailFileLogHandler()
     {
-      int categorySize = strlen(category);
-      if (categorySize < CATSIZEMAX)
-      {
-        memset(res, ' ', CATSIZEMAX);
-        memcpy(res, category, strlen(category));
-      }
-      else
       {
-        memset(res, '.', CATSIZEMAX);
-        memcpy(res + 3, category + categorySize - CATSIZEMAX + 3, CATSIZEMAX - 3);
+        boost::mutex::scoped_lock l(_private->_lock);
+        _private->_stop = true;
+        _private->_rotateCond.notify_all();
       }
-      res[CATSIZEMAX] = '\0';
-    }
+      _private->_rotator.join();
 
+      if (_private->_file != NULL)
+        fclose(_private->_file);
+      delete _private;
+    }
 
     void TailFileLogHandler::log(const qi::log::LogLevel verb,
                                  const qi::os::timeval   date,
@@ -92,73 +224,18 @@ namespace qi {
                                  const char              *fct,
                                  const int               line)
     {
-        if (verb > qi::log::verbosity() || _private->_file == NULL)
-        {
+        char *buffer = detail::lineBuffer();
+        unsigned int size = _private->_formatter.format(buffer, LINESIZEMAX,
+                                                        verb, date, category, msg,
+                                                        file, fct, line);
+
+        // a failed reopen leaves no file
+        boost::mutex::scoped_lock l(_private->_lock);
+        if (_private->_file == NULL)
           return;
-        }
-        else
-        {
-          const char* head = logLevelToString(verb);
-          char fixedCategory[CATSIZEMAX + 1];
-          fixedCategory[CATSIZEMAX] = '\0';
-          _private->cutCat(category, fixedCategory);
-
-          std::stringstream l;
-          std::stringstream ss;
-          ss << date.tv_sec << "." << date.tv_usec;
-
-          l << head << " ";
-          int ctx = qi::log::context();
-          switch (ctx)
-          {
-          case 1:
-            l << fixedCategory << ": ";
-            break;
-          case 2:
-            l << ss.str() << " ";
-            break;
-          case 3:
-            l << file << "(" << line << ") ";
-            break;
-          case 4:
-            l << ss.str() << " " << fixedCategory << ": ";
-            break;
-          case 5:
-            l << ss.str() << " " << file << "(" << line << ") ";
-            break;
-          case 6:
-            l << fixedCategory << ": " << file << "(" << line << ") ";
-            break;
-          case 7:
-            l << ss.str() << " " << fixedCategory << ": " << file << "(" << line << ") " << fct;
-            break;
-          default:
-            break;
-          }
-          l << msg;
-
-          fseek(_private->_file, 0, SEEK_END);
-          fprintf(_private->_file, "%s", l.str().c_str());
-          fflush(_private->_file);
-
-          _private->_writeSize += l.str().size();
-       }
-
-      if (_private->_writeSize > FILESIZEMAX)
-      {
-        fclose(_private->_file);
-        boost::filesystem::path filePath(_private->_fileName);
-        boost::filesystem::path oldFilePath(_private->_fileName + ".old");
-
-        boost::filesystem::copy_file(filePath,
-                                     oldFilePath,
-                                     boost::filesystem::copy_option::overwrite_if_exists);
-
-        FILE* file = qi::os::fopen(filePath.make_preferred().string().c_str(), "w+");
-
-        _private->_file = file;
-        _private->_writeSize = 0;
-      }
+        _private->append(buffer, size);
+        if (_private->_writeSize > _private->_rotateSize)
+          _private->rotate();
     }
   }
 }
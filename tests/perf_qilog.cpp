@@ -0,0 +1,386 @@
+/*
+ * Copyright (c) 2012 Aldebaran Robotics. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the COPYING file.
+ */
+
+/*
+ * Log benchmark: calls per second and call latency percentiles for
+ * several producer threads, synchronous and asynchronous logs, each kind
+ * of statement and each handler. The results are written as JSON.
+ *
+ * $ perf_qilog --threads 8 --count 100000 --dir /dev/shm --output perf.json
+ */
+
+#include <qi/log.hpp>
+#include <qi/os.hpp>
+#include <qi/log/consoleloghandler.hpp>
+#include <qi/log/fileloghandler.hpp>
+#include <qi/log/headfileloghandler.hpp>
+#include <qi/log/tailfileloghandler.hpp>
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/program_options.hpp>
+#include <boost/thread/barrier.hpp>
+#include <boost/thread/thread.hpp>
+
+#ifdef _WIN32
+# include <windows.h>
+#else
+# include <time.h>
+#endif
+
+namespace po = boost::program_options;
+
+static boost::uint64_t nowNs()
+{
+#ifdef _WIN32
+  static LARGE_INTEGER frequency = { 0 };
+  if (!frequency.QuadPart)
+    QueryPerformanceFrequency(&frequency);
+  LARGE_INTEGER now;
+  QueryPerformanceCounter(&now);
+  return (boost::uint64_t)((double)now.QuadPart * 1e9 / (double)frequency.QuadPart);
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (boost::uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+enum Statement {
+  printfStatement = 0,
+  streamStatement,
+  fieldsStatement,
+  disabledStatement
+};
+
+static const char *statementNames[] = { "printf", "stream", "fields", "disabled" };
+
+enum Sink {
+  nullSink = 0,
+  consoleSink,
+  fileSink,
+  bufferedFileSink,
+  headFileSink,
+  tailFileSink,
+  // null handler, every record also copied in a crash ring
+  crashRingSink
+};
+
+static const char *sinkNames[] = { "null", "console", "file", "bufferedfile", "headfile", "tailfile",
+                                   "crashring" };
+
+struct Scenario
+{
+  bool       sync;
+  Statement  statement;
+  Sink       sink;
+  int        threads;
+};
+
+struct Result
+{
+  Scenario              scenario;
+  unsigned long         calls;
+  // producers running time, then time to deliver what was left
+  double                seconds;
+  double                drainSeconds;
+  unsigned long         dropped;
+  // call latency percentiles, in nanoseconds
+  boost::uint64_t       p50;
+  boost::uint64_t       p90;
+  boost::uint64_t       p99;
+  boost::uint64_t       p999;
+  boost::uint64_t       max;
+};
+
+static std::string scenarioName(const Scenario &s)
+{
+  std::ostringstream ss;
+  ss << (s.sync ? "sync" : "async") << "/" << statementNames[s.statement]
+     << "/" << sinkNames[s.sink] << "/" << s.threads;
+  return ss.str();
+}
+
+static void nullHandler(const qi::log::LogRecord *, unsigned int)
+{
+}
+
+struct Producer
+{
+  boost::uint64_t               begin;
+  boost::uint64_t               end;
+  // duration of each call
+  std::vector<boost::uint32_t>  latencies;
+};
+
+// Log count records once all the producers are ready.
+static void produce(Statement        statement,
+                    int              count,
+                    boost::barrier  *start,
+                    Producer        *producer)
+{
+  std::vector<boost::uint32_t> *latencies = &producer->latencies;
+  latencies->resize(count);
+  start->wait();
+  producer->begin = nowNs();
+  for (int i = 0; i < count; ++i)
+  {
+    boost::uint64_t before = nowNs();
+    switch (statement)
+    {
+    case printfStatement:
+      qiLogInfo("bench.log", "value %d of %s", i, "producer");
+      break;
+    case streamStatement:
+      qiLogInfo("bench.log") << "value " << i << " of " << "producer";
+      break;
+    case fieldsStatement:
+      qiLogInfo("bench.log").kv("value", i).kv("of", "producer");
+      break;
+    case disabledStatement:
+      qiLogVerbose("bench.log", "value %d of %s", i, "producer");
+      break;
+    }
+    (*latencies)[i] = (boost::uint32_t)std::min(nowNs() - before, (boost::uint64_t)0xffffffffu);
+  }
+  producer->end = nowNs();
+}
+
+static boost::uint64_t percentile(std::vector<boost::uint32_t> &samples, double p)
+{
+  if (samples.empty())
+    return 0;
+  size_t rank = std::min((size_t)(p * samples.size()), samples.size() - 1);
+  std::nth_element(samples.begin(), samples.begin() + rank, samples.end());
+  return samples[rank];
+}
+
+static Result run(const Scenario &s, int count, const std::string &dir)
+{
+  qi::log::init(qi::log::info, 0, s.sync);
+  qi::log::removeLogHandler("consoleloghandler");
+
+  std::string path = (boost::filesystem::path(dir) / "perf_qilog.log").string();
+  qi::log::ConsoleLogHandler  *console = 0;
+  qi::log::FileLogHandler     *file = 0;
+  qi::log::HeadFileLogHandler *head = 0;
+  qi::log::TailFileLogHandler *tail = 0;
+  switch (s.sink)
+  {
+  case nullSink:
+    qi::log::addLogBatchHandler("bench", nullHandler);
+    break;
+  case consoleSink:
+    console = new qi::log::ConsoleLogHandler;
+    qi::log::addLogHandler("bench", boost::bind(&qi::log::ConsoleLogHandler::log, console,
+                                                _1, _2, _3, _4, _5, _6, _7));
+    break;
+  case fileSink:
+    file = new qi::log::FileLogHandler(path);
+    qi::log::addLogHandler("bench", boost::bind(&qi::log::FileLogHandler::log, file,
+                                                _1, _2, _3, _4, _5, _6, _7));
+    break;
+  case bufferedFileSink:
+    file = new qi::log::FileLogHandler(path, qi::log::FileLogPolicy());
+    qi::log::addLogBatchHandler("bench", boost::bind(&qi::log::FileLogHandler::logBatch, file,
+                                                     _1, _2));
+    qi::log::setLogHandlerFlush("bench", boost::bind(&qi::log::FileLogHandler::flush, file));
+    break;
+  case headFileSink:
+    head = new qi::log::HeadFileLogHandler(path);
+    qi::log::addLogHandler("bench", boost::bind(&qi::log::HeadFileLogHandler::log, head,
+                                                _1, _2, _3, _4, _5, _6, _7));
+    break;
+  case tailFileSink:
+    tail = new qi::log::TailFileLogHandler(path);
+    qi::log::addLogHandler("bench", boost::bind(&qi::log::TailFileLogHandler::log, tail,
+                                                _1, _2, _3, _4, _5, _6, _7));
+    break;
+  case crashRingSink:
+    qi::log::addLogBatchHandler("bench", nullHandler);
+    if (qi::log::setCrashRing(1024 * 1024, path).empty())
+      std::cerr << "cannot map the crash ring " << path << std::endl;
+    break;
+  }
+
+  unsigned long dropped = qi::log::droppedLogs();
+  std::vector<Producer> producers(s.threads);
+  boost::barrier start(s.threads);
+  boost::thread_group threads;
+  for (int i = 0; i < s.threads; ++i)
+    threads.create_thread(boost::bind(&produce, s.statement, count, &start, &producers[i]));
+  threads.join_all();
+  boost::uint64_t begin = producers[0].begin;
+  boost::uint64_t end = producers[0].end;
+  for (int i = 1; i < s.threads; ++i)
+  {
+    begin = std::min(begin, producers[i].begin);
+    end = std::max(end, producers[i].end);
+  }
+  end = std::max(end, begin + 1);
+  qi::log::flush();
+  boost::uint64_t drained = nowNs();
+
+  Result r;
+  r.scenario = s;
+  r.calls = (unsigned long)s.threads * count;
+  r.seconds = (end - begin) / 1e9;
+  r.drainSeconds = (drained - end) / 1e9;
+  r.dropped = qi::log::droppedLogs() - dropped;
+
+  std::vector<boost::uint32_t> samples;
+  samples.reserve(r.calls);
+  for (int i = 0; i < s.threads; ++i)
+    samples.insert(samples.end(), producers[i].latencies.begin(), producers[i].latencies.end());
+  r.p50 = percentile(samples, 0.50);
+  r.p90 = percentile(samples, 0.90);
+  r.p99 = percentile(samples, 0.99);
+  r.p999 = percentile(samples, 0.999);
+  r.max = samples.empty() ? 0 : *std::max_element(samples.begin(), samples.end());
+
+  qi::log::removeLogHandler("bench");
+  if (s.sink == crashRingSink)
+    qi::log::setCrashRing(0);
+  delete console;
+  delete file;
+  delete head;
+  delete tail;
+  boost::filesystem::remove(path);
+  return r;
+}
+
+static void writeJson(std::ostream &out, const std::vector<Result> &results, int count)
+{
+  out << "{\n"
+      << "  \"benchmark\": \"qilog\",\n"
+      << "  \"countPerThread\": " << count << ",\n"
+      << "  \"results\": [";
+  for (unsigned int i = 0; i < results.size(); ++i)
+  {
+    const Result &r = results[i];
+    const Scenario &s = r.scenario;
+    out << (i ? ",\n" : "\n")
+        << "    {\"name\": \"" << scenarioName(s) << "\""
+        << ", \"mode\": \"" << (s.sync ? "sync" : "async") << "\""
+        << ", \"statement\": \"" << statementNames[s.statement] << "\""
+        << ", \"handler\": \"" << sinkNames[s.sink] << "\""
+        << ", \"threads\": " << s.threads
+        << ", \"calls\": " << r.calls
+        << ", \"seconds\": " << r.seconds
+        << ", \"callsPerSecond\": " << (r.seconds > 0 ? r.calls / r.seconds : 0)
+        << ", \"drainSeconds\": " << r.drainSeconds
+        << ", \"dropped\": " << r.dropped
+        << ", \"latencyNs\": {\"p50\": " << r.p50
+        << ", \"p90\": " << r.p90
+        << ", \"p99\": " << r.p99
+        << ", \"p999\": " << r.p999
+        << ", \"max\": " << r.max << "}}";
+  }
+  out << "\n  ]\n}\n";
+}
+
+int main(int argc, char **argv)
+{
+  po::options_description desc("Allowed options");
+  int maxThreads;
+  int count;
+  std::string dir;
+  std::string output;
+  std::string filter;
+
+  desc.add_options()
+    ("help,h", "Produces help message")
+    ("threads,t", po::value<int>(&maxThreads)->default_value(4), "Largest number of producer threads, runs 1, 2, 4... up to it.")
+    ("count,n", po::value<int>(&count)->default_value(100000), "Records logged by each producer thread.")
+    ("dir,d", po::value<std::string>(&dir), "Directory of the file handlers, preferably a tmpfs. Default: /dev/shm if present, else the temporary directory.")
+    ("output,o", po::value<std::string>(&output)->default_value("perf_qilog.json"), "JSON result file, - for the standard output.")
+    ("filter,f", po::value<std::string>(&filter), "Only run the scenarios whose name contains this string, e.g. async/printf.")
+    ;
+
+  po::variables_map vm;
+  try
+  {
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    po::notify(vm);
+  }
+  catch (po::error &e)
+  {
+    std::cerr << e.what() << std::endl;
+    std::cout << desc << std::endl;
+    return 1;
+  }
+
+  if (vm.count("help"))
+  {
+    std::cout << desc << std::endl;
+    return 0;
+  }
+
+  if (dir.empty())
+    dir = boost::filesystem::is_directory("/dev/shm") ? "/dev/shm" : qi::os::tmp();
+
+  // Every statement for 1..N threads without handler cost, then each
+  // handler with a single thread, then the crash ring for 1..N threads.
+  std::vector<Scenario> scenarios;
+  for (int sync = 0; sync < 2; ++sync)
+  {
+    for (int statement = printfStatement; statement <= disabledStatement; ++statement)
+    {
+      for (int threads = 1; threads <= maxThreads; threads *= 2)
+      {
+        Scenario s = { sync != 0, (Statement)statement, nullSink, threads };
+        scenarios.push_back(s);
+      }
+    }
+    for (int sink = consoleSink; sink <= tailFileSink; ++sink)
+    {
+      Scenario s = { sync != 0, printfStatement, (Sink)sink, 1 };
+      scenarios.push_back(s);
+    }
+    for (int threads = 1; threads <= maxThreads; threads *= 2)
+    {
+      Scenario s = { sync != 0, printfStatement, crashRingSink, threads };
+      scenarios.push_back(s);
+    }
+  }
+
+  std::vector<Result> results;
+  for (unsigned int i = 0; i < scenarios.size(); ++i)
+  {
+    std::string name = scenarioName(scenarios[i]);
+    if (!filter.empty() && name.find(filter) == std::string::npos)
+      continue;
+    Result r = run(scenarios[i], count, dir);
+    results.push_back(r);
+    // the console scenarios write to stdout, progress goes to stderr
+    std::cerr << name << ": " << (unsigned long)(r.seconds > 0 ? r.calls / r.seconds : 0)
+              << " calls/s, p99 " << r.p99 << " ns" << std::endl;
+  }
+  qi::log::init();
+
+  if (output == "-")
+  {
+    writeJson(std::cout, results, count);
+    return 0;
+  }
+  std::ofstream out(output.c_str());
+  if (!out)
+  {
+    std::cerr << "cannot write " << output << std::endl;
+    return 1;
+  }
+  writeJson(out, results, count);
+  return 0;
+}
@@ -6,6 +6,19 @@
 #include <gtest/gtest.h>
 #include <qi/log.hpp>
 #include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <sstream>
+#include <vector>
+
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
 
 TEST(log, logasync)
 {
@@ -15,3 +28,840 @@ TEST(log, logasync)
    for (int i = 0; i < 1000; i++)
      qiLogFatal("core.log.test1", "%d\n", i);
 }
+
+static boost::mutex gCheckLock;
+static int          gDelivered = 0;
+static int          gCorrupted = 0;
+
+static void checkHandler(const qi::log::LogLevel /*verb*/,
+                         const qi::os::timeval   /*date*/,
+                         const char              *category,
+                         const char              *msg,
+                         const char              * /*file*/,
+                         const char              * /*fct*/,
+                         const int               /*line*/)
+{
+  int thread, i, check;
+  boost::mutex::scoped_lock l(gCheckLock);
+  if (strcmp(category, "core.log.burst") != 0)
+    return;
+  // each message repeats its payload, a mix of two records breaks it
+  if (sscanf(msg, "%d %d %d", &thread, &i, &check) != 3 ||
+      check != thread * 100000 + i)
+    ++gCorrupted;
+  ++gDelivered;
+}
+
+static void burst(int thread)
+{
+  for (int i = 0; i < 1000; i++)
+    qiLogWarning("core.log.burst", "%d %d %d\n", thread, i, thread * 100000 + i);
+}
+
+// Log a burst from 8 threads, return the number of records lost.
+static int checkBurst(qi::log::LogOverflowPolicy policy)
+{
+  qi::log::init(qi::log::info, 0, false, policy, 10000);
+  qi::log::removeLogHandler("consoleloghandler");
+  qi::log::addLogHandler("check", checkHandler);
+  unsigned long droppedBefore = qi::log::droppedLogs(qi::log::warning);
+  gDelivered = 0;
+  gCorrupted = 0;
+
+  boost::thread_group producers;
+  for (int t = 0; t < 8; ++t)
+    producers.create_thread(boost::bind(&burst, t));
+  producers.join_all();
+  qi::log::flush();
+
+  boost::mutex::scoped_lock l(gCheckLock);
+  int dropped = (int)(qi::log::droppedLogs(qi::log::warning) - droppedBefore);
+  EXPECT_EQ(0, gCorrupted);
+  EXPECT_EQ(8 * 1000, gDelivered + dropped);
+  return dropped;
+}
+
+TEST(log, logasyncburst)
+{
+  checkBurst(qi::log::dropNewest);
+  checkBurst(qi::log::dropOldest);
+  checkBurst(qi::log::spillToPool);
+  EXPECT_EQ(0, checkBurst(qi::log::blockWithTimeout));
+  qi::log::init(qi::log::info, 0, false);
+}
+
+static std::vector<std::string> gMessages;
+
+static void messageHandler(const qi::log::LogLevel /*verb*/,
+                           const qi::os::timeval   /*date*/,
+                           const char              *category,
+                           const char              *msg,
+                           const char              * /*file*/,
+                           const char              * /*fct*/,
+                           const int               /*line*/)
+{
+  boost::mutex::scoped_lock l(gCheckLock);
+  if (strcmp(category, "core.log.deferred") == 0)
+    gMessages.push_back(msg);
+}
+
+static void logFormats()
+{
+  const char *str = "nao";
+  qiLogWarning("core.log.deferred", "%d %s %5.2f %*d %% %c", -42, str, 3.14159, 6, 7, 'x');
+  qiLogWarning("core.log.deferred", "%.2s|%-5s|%lu|%lld|%x", str, "ab", 123456789ul, -1234567890123ll, 255u);
+  qiLogWarning("core.log.deferred", "%p %hd %zu\n", (void *)0x1234, (short)-3, (size_t)17);
+  qiLogWarning("core.log.deferred", "%d and", 1) << " a suffix " << 2;
+  qiLogWarning("core.log.deferred", "%s", "");
+  qiLogWarning("core.log.deferred", "%ls", L"wide");
+}
+
+// Keeps the log thread busy a while on the "core.log.slow" records.
+static void busyHandler(const qi::log::LogRecord *records, unsigned int count)
+{
+  for (unsigned int i = 0; i < count; ++i)
+  {
+    if (strcmp(records[i].category, "core.log.slow") == 0)
+      qi::os::msleep(100);
+  }
+}
+
+TEST(log, logdeferredformatting)
+{
+  qi::log::init(qi::log::info, 0, false);
+  qi::log::removeLogHandler("consoleloghandler");
+  qi::log::addLogHandler("messages", messageHandler);
+
+  gMessages.clear();
+  logFormats();
+  qi::log::flush();
+  std::vector<std::string> immediate = gMessages;
+
+  qi::log::setDeferredFormatting(true);
+  gMessages.clear();
+  logFormats();
+  qi::log::flush();
+  qi::log::setDeferredFormatting(false);
+
+  ASSERT_EQ(6u, immediate.size());
+  EXPECT_EQ("-42 nao  3.14      7 % x\n", immediate[0]);
+  EXPECT_EQ("1 and a suffix 2\n", immediate[3]);
+  EXPECT_TRUE(immediate == gMessages);
+
+  // the format is formatted later than the call, from a copy
+  qi::log::addLogBatchHandler("busy", busyHandler);
+  qi::log::setDeferredFormatting(true);
+  qiLogInfo("core.log.slow", "busy");
+  qi::os::msleep(10);
+  char format[32];
+  strcpy(format, "reused %d");
+  gMessages.clear();
+  qiLogInfo("core.log.deferred", format, 7);
+  strcpy(format, "overwritten %s");
+  qi::log::flush();
+  qi::log::setDeferredFormatting(false);
+  qi::log::removeLogHandler("busy");
+  ASSERT_EQ(1u, gMessages.size());
+  EXPECT_EQ("reused 7\n", gMessages[0]);
+
+  qi::log::removeLogHandler("messages");
+  qi::log::init(qi::log::info, 0, false);
+}
+
+static int          gBatchRecords = 0;
+static int          gBatchDisorder = 0;
+
+static void batchHandler(const qi::log::LogRecord *records, unsigned int count)
+{
+  boost::mutex::scoped_lock l(gCheckLock);
+  for (unsigned int i = 0; i < count; ++i)
+  {
+    if (strcmp(records[i].category, "core.log.batch") != 0)
+      continue;
+    if (atoi(records[i].message) != gBatchRecords)
+      ++gBatchDisorder;
+    ++gBatchRecords;
+  }
+}
+
+TEST(log, logbatchhandler)
+{
+  qi::log::init(qi::log::info, 0, false);
+  qi::log::removeLogHandler("consoleloghandler");
+  qi::log::addLogBatchHandler("batch", batchHandler);
+  qi::log::addLogHandler("messages", messageHandler);
+  gMessages.clear();
+  gBatchRecords = 0;
+  gBatchDisorder = 0;
+
+  for (int i = 0; i < 100; i++)
+    qiLogWarning("core.log.batch", "%d", i);
+  qiLogWarning("core.log.deferred", "legacy");
+  qi::log::flush();
+
+  boost::mutex::scoped_lock l(gCheckLock);
+  EXPECT_EQ(100, gBatchRecords);
+  EXPECT_EQ(0, gBatchDisorder);
+  ASSERT_EQ(1u, gMessages.size());
+  EXPECT_EQ("legacy\n", gMessages[0]);
+  l.unlock();
+
+  qi::log::removeLogHandler("batch");
+  qi::log::removeLogHandler("fast");
+  qi::log::init(qi::log::info, 0, false);
+}
+
+TEST(log, logvariablerecords)
+{
+  qi::log::setBufferSize(16 * 1024);
+  EXPECT_EQ(16u * 1024, qi::log::bufferSize());
+  qi::log::init(qi::log::info, 0, false, qi::log::blockWithTimeout, 10000);
+  qi::log::removeLogHandler("consoleloghandler");
+  qi::log::addLogHandler("messages", messageHandler);
+  gMessages.clear();
+
+  // records of every size wrap around the small ring many times
+  for (int i = 0; i < 2000; i++)
+  {
+    std::string payload(i % 300, 'a' + i % 26);
+    qiLogWarning("core.log.deferred", "%d %s", i, payload.c_str());
+  }
+  std::string big(3000, 'x');
+  qi::log::log(qi::log::warning, "core.log.deferred", big.c_str());
+  qi::log::flush();
+
+  boost::mutex::scoped_lock l(gCheckLock);
+  ASSERT_EQ(2001u, gMessages.size());
+  for (int i = 0; i < 2000; i++)
+  {
+    std::ostringstream ss;
+    ss << i << " " << std::string(i % 300, 'a' + i % 26) << "\n";
+    EXPECT_EQ(ss.str(), gMessages[i]);
+  }
+  EXPECT_EQ(big + "\n", gMessages[2000]);
+  l.unlock();
+
+  qi::log::removeLogHandler("messages");
+  qi::log::setBufferSize(64 * 1024);
+  qi::log::init(qi::log::info, 0, false);
+}
+
+// Without flush, each record must reach the handler on its own.
+static void checkWakeup()
+{
+  gMessages.clear();
+  for (int i = 0; i < 50; i++)
+  {
+    unsigned int expected = i + 1;
+    qiLogWarning("core.log.deferred", "%d", i);
+    for (int wait = 0; wait < 1000; ++wait)
+    {
+      {
+        boost::mutex::scoped_lock l(gCheckLock);
+        if (gMessages.size() == expected)
+          break;
+      }
+      qi::os::msleep(1);
+    }
+    boost::mutex::scoped_lock l(gCheckLock);
+    ASSERT_EQ(expected, gMessages.size());
+  }
+}
+
+TEST(log, logwakeup)
+{
+  qi::log::setWakeup(1000);
+  qi::log::init(qi::log::info, 0, false);
+  qi::log::removeLogHandler("consoleloghandler");
+  qi::log::addLogHandler("messages", messageHandler);
+  checkWakeup();
+
+  qi::log::setWakeup(1000, 200);
+  qi::log::init(qi::log::info, 0, false);
+  qi::log::removeLogHandler("consoleloghandler");
+  qi::log::addLogHandler("messages", messageHandler);
+  checkWakeup();
+
+  qi::log::removeLogHandler("messages");
+  qi::log::setWakeup(100);
+  qi::log::init(qi::log::info, 0, false);
+}
+
+static boost::atomic<int> gSlowRecords(0);
+static boost::atomic<int> gFastRecords(0);
+
+static void fastHandler(const qi::log::LogRecord *records, unsigned int count)
+{
+  for (unsigned int i = 0; i < count; ++i)
+  {
+    if (strcmp(records[i].category, "core.log.sink") == 0)
+      gFastRecords.fetch_add(1);
+  }
+}
+
+static void slowHandler(const qi::log::LogRecord *records, unsigned int count)
+{
+  for (unsigned int i = 0; i < count; ++i)
+  {
+    if (strcmp(records[i].category, "core.log.sink") == 0)
+      gSlowRecords.fetch_add(1);
+  }
+  qi::os::msleep(5);
+}
+
+TEST(log, logsinkworker)
+{
+  qi::log::init(qi::log::info, 0, false, qi::log::blockWithTimeout, 10000);
+  qi::log::removeLogHandler("consoleloghandler");
+  qi::log::addLogBatchHandler("slow", slowHandler, 16 * 1024);
+  qi::log::addLogBatchHandler("fast", fastHandler);
+  gSlowRecords.store(0);
+  gFastRecords.store(0);
+
+  for (int i = 0; i < 1000; i++)
+    qiLogWarning("core.log.sink", "%d", i);
+
+  // the fast handler does not wait for the slow one
+  for (int i = 0; i < 5000 && gFastRecords.load() < 1000; ++i)
+    qi::os::msleep(1);
+  EXPECT_EQ(1000, gFastRecords.load());
+  qi::log::LogHandlerStats stats = qi::log::handlerStats("slow");
+  EXPECT_GT(stats.lag + stats.dropped, 0u);
+
+  // flush waits for the queue of the slow one too
+  qi::log::flush();
+  stats = qi::log::handlerStats("slow");
+  EXPECT_EQ(0u, stats.lag);
+  EXPECT_EQ(1000, gSlowRecords.load() + (int)stats.dropped);
+
+  // removing the handler waits for its queue
+  qiLogWarning("core.log.sink", "last");
+  qi::log::removeLogHandler("slow");
+  EXPECT_EQ(1001, gSlowRecords.load() + (int)stats.dropped);
+
+  qi::log::removeLogHandler("fast");
+  qi::log::init(qi::log::info, 0, false);
+}
+
+static boost::mutex       gGateLock;
+static bool               gGateOpen = true;
+static boost::atomic<int> gGateRecords(0);
+static boost::atomic<int> gSelfFlushes(0);
+
+static void gateHandler(const qi::log::LogRecord * /*records*/, unsigned int count)
+{
+  while (true)
+  {
+    boost::mutex::scoped_lock l(gGateLock);
+    if (gGateOpen)
+      break;
+    l.unlock();
+    qi::os::msleep(1);
+  }
+  gGateRecords.fetch_add(count);
+}
+
+// A handler cannot wait for its own delivery.
+static void flushingHandler(const qi::log::LogRecord *records, unsigned int count)
+{
+  for (unsigned int i = 0; i < count; ++i)
+  {
+    if (strcmp(records[i].category, "core.log.flush.self") == 0 && !qi::log::flush(10))
+      gSelfFlushes.fetch_add(1);
+  }
+}
+
+static void produceRecords(int count)
+{
+  for (int i = 0; i < count; ++i)
+    qiLogInfo("core.log.flush", "%d", i);
+}
+
+TEST(log, logflush)
+{
+  qi::log::init(qi::log::info, 0, false, qi::log::blockWithTimeout, 10000);
+  qi::log::removeLogHandler("consoleloghandler");
+  qi::log::addLogBatchHandler("gate", gateHandler);
+  gGateRecords.store(0);
+
+  // every record logged before flush returns was delivered, even while
+  // other threads keep logging
+  boost::thread_group threads;
+  for (int i = 0; i < 4; ++i)
+    threads.create_thread(boost::bind(&produceRecords, 2000));
+  for (int i = 0; i < 1000; ++i)
+    qiLogInfo("core.log.flush", "%d", i);
+  qi::log::flush();
+  EXPECT_GE(gGateRecords.load(), 1000);
+  threads.join_all();
+  qi::log::flush();
+  EXPECT_EQ(9000, gGateRecords.load());
+
+  // the timeout expires while the handler is stuck
+  {
+    boost::mutex::scoped_lock l(gGateLock);
+    gGateOpen = false;
+  }
+  qiLogInfo("core.log.flush", "stuck");
+  EXPECT_FALSE(qi::log::flush(50));
+  {
+    boost::mutex::scoped_lock l(gGateLock);
+    gGateOpen = true;
+  }
+  EXPECT_TRUE(qi::log::flush(10000));
+  EXPECT_EQ(9001, gGateRecords.load());
+
+  // same for a handler on its own thread
+  qi::log::removeLogHandler("gate");
+  qi::log::addLogBatchHandler("gate", gateHandler, 1024);
+  {
+    boost::mutex::scoped_lock l(gGateLock);
+    gGateOpen = false;
+  }
+  qiLogInfo("core.log.flush", "queued");
+  EXPECT_FALSE(qi::log::flush(50));
+  {
+    boost::mutex::scoped_lock l(gGateLock);
+    gGateOpen = true;
+  }
+  EXPECT_TRUE(qi::log::flush(10000));
+  EXPECT_EQ(9002, gGateRecords.load());
+
+  gSelfFlushes.store(0);
+  qi::log::addLogBatchHandler("self", flushingHandler);
+  qiLogInfo("core.log.flush.self", "flush from a handler");
+  EXPECT_TRUE(qi::log::flush(10000));
+  EXPECT_EQ(1, gSelfFlushes.load());
+
+  qi::log::removeLogHandler("self");
+  qi::log::removeLogHandler("gate");
+  qi::log::init(qi::log::info, 0, false);
+}
+
+TEST(log, logflushsyncswitch)
+{
+  // the synchronous records are delivered by their caller, a flush after
+  // switching a threaded instance to them has nothing to wait for
+  qi::log::init(qi::log::info, 0, false);
+  qi::log::setSynchronousLog(true);
+  qiLogInfo("core.log.switch") << "hello";
+  qi::log::flush();
+
+  qi::log::init(qi::log::info, 0, false);
+}
+
+static boost::atomic<int> gHookRecords(0);
+static boost::atomic<int> gHookFlushes(0);
+static boost::atomic<int> gHookSeen(0);
+
+static void hookHandler(const qi::log::LogRecord *records, unsigned int count)
+{
+  for (unsigned int i = 0; i < count; ++i)
+    if (strcmp(records[i].category, "core.log.hook") == 0)
+      ++gHookRecords;
+}
+
+static void hookFlush()
+{
+  ++gHookFlushes;
+  gHookSeen.store(gHookRecords.load());
+}
+
+TEST(log, logflushhook)
+{
+  qi::log::init(qi::log::info, 0, false);
+  qi::log::removeLogHandler("consoleloghandler");
+  gHookRecords.store(0);
+  gHookFlushes.store(0);
+  gHookSeen.store(0);
+  qi::log::addLogBatchHandler("hook", hookHandler);
+  qi::log::setLogHandlerFlush("hook", hookFlush);
+
+  // the hook runs once the records before the flush were delivered
+  for (int i = 0; i < 100; ++i)
+    qiLogInfo("core.log.hook") << i;
+  qi::log::flush();
+  EXPECT_LE(1, gHookFlushes.load());
+  EXPECT_EQ(100, gHookSeen.load());
+
+  // and by destroy, after the last records
+  int flushes = gHookFlushes.load();
+  for (int i = 0; i < 10; ++i)
+    qiLogInfo("core.log.hook") << i;
+  qi::log::destroy();
+  EXPECT_LT(flushes, gHookFlushes.load());
+  EXPECT_EQ(110, gHookSeen.load());
+
+  qi::log::init(qi::log::info, 0, false);
+}
+
+static std::vector<qi::log::LogField> gFields;
+static std::vector<std::string>       gStrings;
+
+static void fieldHandler(const qi::log::LogRecord *records, unsigned int count)
+{
+  boost::mutex::scoped_lock l(gCheckLock);
+  for (unsigned int i = 0; i < count; ++i)
+  {
+    if (strcmp(records[i].category, "core.log.deferred") != 0)
+      continue;
+    for (unsigned int j = 0; j < records[i].fieldCount; ++j)
+    {
+      gFields.push_back(records[i].fields[j]);
+      // the strings only live during the call
+      if (records[i].fields[j].type == qi::log::stringField)
+        gStrings.push_back(records[i].fields[j].value.s);
+    }
+  }
+}
+
+TEST(log, logfields)
+{
+  qi::log::init(qi::log::info, 0, false);
+  qi::log::removeLogHandler("consoleloghandler");
+  qi::log::addLogHandler("messages", messageHandler);
+  qi::log::addLogBatchHandler("fields", fieldHandler);
+  qi::log::setDeferredFormatting(true);
+
+  gMessages.clear();
+  gFields.clear();
+  std::string side("left arm");
+  qiLogInfo("core.log.deferred").kv("joint", 3).kv("torque", 1.5).kv("side", side)
+    .kv("ok", true).kv("count", 7ul);
+  qiLogInfo("core.log.deferred", "%s", "overheat").kv("temp", -12) << " again";
+  qiLogInfo("core.log.deferred") << "no fields";
+  qi::log::flush();
+  qi::log::setDeferredFormatting(false);
+
+  ASSERT_EQ(3u, gMessages.size());
+  EXPECT_EQ("joint=3 torque=1.5 side=\"left arm\" ok=true count=7\n", gMessages[0]);
+  EXPECT_EQ("overheat again temp=-12\n", gMessages[1]);
+  EXPECT_EQ("no fields\n", gMessages[2]);
+
+  ASSERT_EQ(6u, gFields.size());
+  EXPECT_STREQ("joint", gFields[0].key);
+  EXPECT_EQ(qi::log::intField, gFields[0].type);
+  EXPECT_EQ(3, gFields[0].value.i);
+  EXPECT_EQ(qi::log::doubleField, gFields[1].type);
+  EXPECT_EQ(1.5, gFields[1].value.d);
+  ASSERT_EQ(1u, gStrings.size());
+  EXPECT_EQ("left arm", gStrings[0]);
+  EXPECT_EQ(qi::log::boolField, gFields[3].type);
+  EXPECT_TRUE(gFields[3].value.b);
+  EXPECT_EQ(qi::log::uintField, gFields[4].type);
+  EXPECT_EQ(7u, gFields[4].value.u);
+  EXPECT_EQ(-12, gFields[5].value.i);
+
+  // too many fields are dropped, not the record
+  gMessages.clear();
+  qiLogInfo("core.log.deferred").kv("a", 1).kv("b", 2).kv("c", 3).kv("d", 4).kv("e", 5)
+    .kv("f", 6).kv("g", 7).kv("h", 8).kv("i", 9).kv("j", 10).kv("k", 11).kv("l", 12)
+    .kv("m", 13).kv("n", 14).kv("o", 15).kv("p", 16).kv("q", 17) << "text";
+  qi::log::flush();
+  ASSERT_EQ(1u, gMessages.size());
+  EXPECT_EQ(0u, gMessages[0].find("text a=1 "));
+  EXPECT_EQ(std::string::npos, gMessages[0].find("q=17"));
+
+  qi::log::removeLogHandler("fields");
+  qi::log::removeLogHandler("messages");
+  qi::log::init(qi::log::info, 0, false);
+}
+
+static boost::atomic<int> gStatsRecords(0);
+static boost::atomic<int> gStatsReports(0);
+
+static void statsHandler(const qi::log::LogRecord *records, unsigned int count)
+{
+  for (unsigned int i = 0; i < count; ++i)
+  {
+    if (strcmp(records[i].category, "core.log.stats") == 0)
+      ++gStatsRecords;
+    if (strcmp(records[i].category, "qi.log.stats") == 0 && records[i].fieldCount > 0 &&
+        strcmp(records[i].fields[0].key, "logged") == 0)
+      ++gStatsReports;
+  }
+}
+
+static unsigned long histogramTotal(const unsigned long *histogram)
+{
+  unsigned long total = 0;
+  for (int i = 0; i < qi::log::LogHistogramSize; ++i)
+    total += histogram[i];
+  return total;
+}
+
+TEST(log, logstats)
+{
+  qi::log::init(qi::log::info, 0, false);
+  qi::log::removeLogHandler("consoleloghandler");
+  qi::log::addLogBatchHandler("stats", statsHandler);
+
+  qi::log::LogStats before = qi::log::stats();
+  for (int i = 0; i < 100; ++i)
+    qiLogInfo("core.log.stats") << "record " << i;
+  qi::log::flush();
+  EXPECT_EQ(100, gStatsRecords.load());
+
+  qi::log::LogStats after = qi::log::stats();
+  EXPECT_EQ(before.logged[qi::log::info] + 100, after.logged[qi::log::info]);
+  EXPECT_GE(histogramTotal(after.latency), histogramTotal(before.latency) + 100);
+  EXPECT_GE(after.rings, 1u);
+  EXPECT_GE(after.ringBytes, after.queuedBytes);
+
+  bool found = false;
+  for (unsigned int i = 0; i < after.categories.size(); ++i)
+  {
+    if (strcmp(after.categories[i].name, "core.log.stats") == 0)
+    {
+      EXPECT_EQ(100u, after.categories[i].logged);
+      found = true;
+    }
+  }
+  EXPECT_TRUE(found);
+
+  ASSERT_EQ(1u, after.handlers.size());
+  EXPECT_EQ("stats", after.handlers[0].name);
+  EXPECT_GE(after.handlers[0].delivered, 100u);
+  EXPECT_EQ(after.handlers[0].calls, histogramTotal(after.handlers[0].time));
+  qi::log::LogHandlerStats handler = qi::log::handlerStats("stats");
+  EXPECT_GE(handler.calls, after.handlers[0].calls);
+
+  // the log thread reports the counters periodically
+  qi::log::setStatsReport(10);
+  for (int i = 0; i < 100 && gStatsReports.load() < 2; ++i)
+    qi::os::msleep(10);
+  qi::log::setStatsReport(0);
+  EXPECT_GE(gStatsReports.load(), 2);
+
+  qi::log::removeLogHandler("stats");
+  qi::log::init(qi::log::info, 0, false);
+}
+
+static std::vector<std::string> gCrashMessages;
+static std::vector<std::string> gCrashCategories;
+static unsigned int             gCrashFields = 0;
+static std::vector<boost::uint64_t> gCrashTimestamps;
+
+static void crashHandler(const qi::log::LogRecord *records, unsigned int count)
+{
+  for (unsigned int i = 0; i < count; ++i)
+  {
+    gCrashTimestamps.push_back(records[i].timestamp);
+    gCrashMessages.push_back(records[i].message);
+    gCrashCategories.push_back(records[i].category);
+    gCrashFields += records[i].fieldCount;
+  }
+}
+
+static void produceCrashRecords(int thread)
+{
+  for (int i = 0; i < 200; ++i)
+    qiLogInfo("core.log.crash.thread", "thread %d record %d", thread, i);
+}
+
+TEST(log, logcrashring)
+{
+  qi::log::init(qi::log::info, 0, false);
+  qi::log::removeLogHandler("consoleloghandler");
+
+  std::stringstream ss;
+  ss << qi::os::tmp() << "/test_qilog_" << qi::os::getpid() << ".ring";
+  std::string path = qi::log::setCrashRing(16 * 1024, ss.str());
+  ASSERT_EQ(ss.str(), path);
+
+  // more than the ring holds, the first records are overwritten
+  for (int i = 0; i < 500; ++i)
+    qiLogInfo("core.log.crash", "record %d", i);
+  qi::log::setDeferredFormatting(true);
+  qiLogWarning("core.log.crash.deferred", "%s %d", "deferred", 42).kv("joint", 3);
+  qi::log::setDeferredFormatting(false);
+  qiLogVerbose("core.log.crash", "disabled");
+
+  gCrashMessages.clear();
+  gCrashCategories.clear();
+  gCrashFields = 0;
+  // no flush: the ring is written by the caller, not the log thread
+  ASSERT_TRUE(qi::log::readCrashRing(path, crashHandler, 10));
+  ASSERT_EQ(10u, gCrashMessages.size());
+  for (int i = 0; i < 9; ++i)
+  {
+    std::stringstream expected;
+    expected << "record " << 491 + i;
+    EXPECT_EQ(expected.str(), gCrashMessages[i]);
+  }
+  EXPECT_EQ("deferred 42", gCrashMessages[9]);
+  EXPECT_EQ("core.log.crash.deferred", gCrashCategories[9]);
+  EXPECT_EQ(1u, gCrashFields);
+
+  gCrashMessages.clear();
+  ASSERT_TRUE(qi::log::readCrashRing(path, crashHandler));
+  EXPECT_GT(gCrashMessages.size(), 10u);
+  EXPECT_LT(gCrashMessages.size(), 501u);
+  EXPECT_EQ("deferred 42", gCrashMessages.back());
+
+  // the ring cuts long formats, possibly inside a conversion
+  std::string longFormat(252, 'x');
+  longFormat += "%10.3f";
+  qi::log::setDeferredFormatting(true);
+  qiLogWarning("core.log.crash.deferred", longFormat.c_str(), 1.5);
+  qi::log::setDeferredFormatting(false);
+  gCrashMessages.clear();
+  ASSERT_TRUE(qi::log::readCrashRing(path, crashHandler, 1));
+  ASSERT_EQ(1u, gCrashMessages.size());
+  EXPECT_EQ(std::string(252, 'x'), gCrashMessages[0]);
+
+  // a damaged field stops the decoding of the fields, not of the record
+  qiLogWarning("core.log.crash", "damaged").kv("damaged", 7);
+  {
+    std::fstream file(path.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+    std::string content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    // the key and its value, 7 in little endian
+    std::string::size_type key = content.rfind(std::string("damaged\0\x07\0\0\0\0\0\0\0", 16));
+    ASSERT_NE(std::string::npos, key);
+    // the length of the value, just before the key
+    file.seekp(key - 2);
+    file.write("\xff\xff", 2);
+  }
+  gCrashMessages.clear();
+  gCrashFields = 0;
+  ASSERT_TRUE(qi::log::readCrashRing(path, crashHandler, 1));
+  ASSERT_EQ(1u, gCrashMessages.size());
+  EXPECT_EQ("damaged", gCrashMessages[0]);
+  EXPECT_EQ(0u, gCrashFields);
+
+  // the threads write in chunks of their own, read back in order
+  ASSERT_EQ(path, qi::log::setCrashRing(1024 * 1024, path));
+  boost::thread_group threads;
+  for (int t = 0; t < 4; ++t)
+    threads.create_thread(boost::bind(&produceCrashRecords, t));
+  threads.join_all();
+  gCrashMessages.clear();
+  gCrashTimestamps.clear();
+  ASSERT_TRUE(qi::log::readCrashRing(path, crashHandler));
+  ASSERT_EQ(800u, gCrashMessages.size());
+  int next[4] = { 0, 0, 0, 0 };
+  for (unsigned int i = 0; i < gCrashMessages.size(); ++i)
+  {
+    int thread = -1;
+    int record = -1;
+    ASSERT_EQ(2, sscanf(gCrashMessages[i].c_str(), "thread %d record %d", &thread, &record));
+    ASSERT_TRUE(thread >= 0 && thread < 4);
+    EXPECT_EQ(next[thread]++, record);
+    if (i)
+    {
+      EXPECT_LE(gCrashTimestamps[i - 1], gCrashTimestamps[i]);
+    }
+  }
+
+  EXPECT_EQ("", qi::log::setCrashRing(0));
+  EXPECT_FALSE(qi::log::readCrashRing(path + ".missing", crashHandler));
+  qi::log::init(qi::log::info, 0, false);
+  remove(path.c_str());
+}
+
+static boost::atomic<int> gShutdownRecords(0);
+
+static void shutdownHandler(const qi::log::LogRecord *records, unsigned int count)
+{
+  for (unsigned int i = 0; i < count; ++i)
+  {
+    if (strcmp(records[i].category, "core.log.shutdown") == 0)
+      gShutdownRecords.fetch_add(1);
+  }
+}
+
+static boost::mutex             gFreshLock;
+static std::vector<std::string> gFresh;
+
+static void freshHandler(const qi::log::LogRecord *records, unsigned int count)
+{
+  boost::mutex::scoped_lock l(gFreshLock);
+  for (unsigned int i = 0; i < count; ++i)
+  {
+    if (strcmp(records[i].category, "core.log.flush") == 0)
+      gFresh.push_back(records[i].message);
+  }
+}
+
+static void produceShutdownRecords(int count)
+{
+  for (int i = 0; i < count; ++i)
+    qiLogInfo("core.log.shutdown", "%d", i);
+}
+
+TEST(log, logshutdown)
+{
+  // every record is either delivered or counted as lost, even when
+  // logging while destroying
+  qi::log::init(qi::log::info, 0, false, qi::log::blockWithTimeout, 10000);
+  qi::log::removeLogHandler("consoleloghandler");
+  qi::log::addLogBatchHandler("shutdown", shutdownHandler);
+  gShutdownRecords.store(0);
+  unsigned long lost = qi::log::stats().lost;
+
+  boost::thread_group threads;
+  for (int i = 0; i < 4; ++i)
+    threads.create_thread(boost::bind(&produceShutdownRecords, 5000));
+  qi::os::msleep(1);
+  qi::log::destroy();
+  threads.join_all();
+  EXPECT_EQ(20000u, gShutdownRecords.load() + qi::log::stats().lost - lost);
+
+  // a stuck handler does not hang the shutdown, its records are lost
+  qi::log::setShutdownTimeout(50);
+  qi::log::init(qi::log::info, 0, false);
+  qi::log::removeLogHandler("consoleloghandler");
+  qi::log::addLogBatchHandler("gate", gateHandler);
+  {
+    boost::mutex::scoped_lock l(gGateLock);
+    gGateOpen = false;
+  }
+  qiLogInfo("core.log.flush", "stuck");
+  qiLogInfo("core.log.flush", "behind");
+  lost = qi::log::stats().lost;
+  int gated = gGateRecords.load();
+  qi::log::destroy();
+  EXPECT_GE(qi::log::stats().lost - lost, 1u);
+  {
+    boost::mutex::scoped_lock l(gGateLock);
+    gGateOpen = true;
+  }
+  // the abandoned log thread must be out of the handler before the
+  // process exits and destroys the gate
+  for (int i = 0; i < 1000 && gGateRecords.load() == gated; ++i)
+    qi::os::msleep(1);
+
+  // the next instance skips what the abandoned one left in the rings: it
+  // was counted as lost, and must not count as consumed by the new one
+  qi::log::init(qi::log::info, 0, false);
+  qi::log::addLogBatchHandler("fresh", freshHandler);
+  qiLogInfo("core.log.flush", "fresh");
+  qi::log::flush();
+  {
+    boost::mutex::scoped_lock l(gFreshLock);
+    ASSERT_EQ(1u, gFresh.size());
+    EXPECT_EQ("fresh\n", gFresh[0]);
+  }
+  qi::log::removeLogHandler("fresh");
+  qi::log::setShutdownTimeout(1000);
+
+  // init() switches the mode before destroying the synchronous instance,
+  // which has no log thread to wait for
+  qi::log::init(qi::log::info, 0, true);
+  qi::log::removeLogHandler("consoleloghandler");
+  qiLogInfo("core.log.flush", "synchronous");
+  lost = qi::log::stats().lost;
+  boost::system_time before = boost::get_system_time();
+  qi::log::init(qi::log::info, 0, false);
+  EXPECT_LT((boost::get_system_time() - before).total_milliseconds(), 500);
+  EXPECT_EQ(lost, qi::log::stats().lost);
+
+  // nor does a threaded instance switched to synchronous logs
+  qi::log::setSynchronousLog(true);
+  qiLogInfo("core.log.switch") << "hello";
+  before = boost::get_system_time();
+  qi::log::destroy();
+  EXPECT_LT((boost::get_system_time() - before).total_milliseconds(), 500);
+  EXPECT_EQ(lost, qi::log::stats().lost);
+  qi::log::init(qi::log::info, 0, false);
+}
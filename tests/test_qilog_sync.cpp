@@ -5,7 +5,29 @@
  */
 #include <gtest/gtest.h>
 #include <qi/log.hpp>
+#include <qi/log/logformatter.hpp>
+#include <qi/log/consoleloghandler.hpp>
+#include <qi/log/fileloghandler.hpp>
+#include <qi/log/tailfileloghandler.hpp>
+#include <algorithm>
 #include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/thread/thread.hpp>
+#include <qi/os.hpp>
+
+#ifndef _WIN32
+# include <fcntl.h>
+# include <sys/socket.h>
+# include <sys/stat.h>
+# include <unistd.h>
+#endif
 
 TEST(log, logsync)
 {
@@ -15,3 +37,680 @@ TEST(log, logsync)
    for (int i = 0; i < 1000; i++)
      qiLogFatal("core.log.test1", "%d\n", i);
 }
+
+static std::string gLastMessage;
+
+static void lastHandler(const qi::log::LogLevel /*verb*/,
+                        const qi::os::timeval   /*date*/,
+                        const char              * /*category*/,
+                        const char              *msg,
+                        const char              * /*file*/,
+                        const char              * /*fct*/,
+                        const int               /*line*/)
+{
+  gLastMessage = msg;
+}
+
+TEST(log, logstreamtruncate)
+{
+  qi::log::init(qi::log::info, 0, true);
+  qi::log::removeLogHandler("consoleloghandler");
+  qi::log::addLogHandler("last", lastHandler);
+
+  qiLogInfo("core.log.test2", "%d %s", 42, "foo") << " bar " << 3.5;
+  EXPECT_EQ("42 foo bar 3.5\n", gLastMessage);
+
+  std::string big(5000, 'x');
+  qiLogInfo("core.log.test2") << big << "lost";
+  EXPECT_GT(gLastMessage.size(), 1000u);
+  EXPECT_LT(gLastMessage.size(), 2049u);
+  EXPECT_EQ(std::string::npos, gLastMessage.find("lost"));
+
+  qiLogInfo("core.log.test2", "%s", big.c_str()) << "lost";
+  EXPECT_LT(gLastMessage.size(), 2049u);
+  EXPECT_EQ(std::string::npos, gLastMessage.find("lost"));
+
+  qi::log::init(qi::log::info, 0, true);
+}
+
+static int gEvaluated = 0;
+
+static int evaluate()
+{
+  return ++gEvaluated;
+}
+
+TEST(log, logdisabledlevel)
+{
+  qi::log::init(qi::log::warning, 0, true);
+  qi::log::removeLogHandler("consoleloghandler");
+  qi::log::addLogHandler("last", lastHandler);
+  gLastMessage = "";
+
+  qiLogVerbose("core.log.test3") << evaluate();
+  qiLogInfo("core.log.test3", "%d", evaluate());
+  EXPECT_EQ(0, gEvaluated);
+  EXPECT_EQ("", gLastMessage);
+
+  qiLogWarning("core.log.test3") << evaluate();
+  EXPECT_EQ(1, gEvaluated);
+  EXPECT_EQ("1\n", gLastMessage);
+
+  qi::log::init(qi::log::info, 0, true);
+}
+
+static void logCategory(const char *category)
+{
+  qiLogVerbose(category) << category;
+}
+
+TEST(log, logcategoryverbosity)
+{
+  qi::log::init(qi::log::info, 0, true);
+  qi::log::removeLogHandler("consoleloghandler");
+  qi::log::addLogHandler("last", lastHandler);
+
+  qi::log::setCategoryVerbosity("motion.*", qi::log::verbose);
+  qi::log::setCategoryVerbosity("motion.walk", qi::log::error);
+  EXPECT_EQ(qi::log::verbose, qi::log::verbosity("motion.arm"));
+  EXPECT_EQ(qi::log::error, qi::log::verbosity("motion.walk"));
+  EXPECT_EQ(qi::log::info, qi::log::verbosity("audio"));
+
+  gLastMessage = "";
+  qiLogVerbose("motion.arm") << "arm";
+  EXPECT_EQ("arm\n", gLastMessage);
+  qiLogWarning("motion.walk") << "walk";
+  EXPECT_EQ("arm\n", gLastMessage);
+  qiLogVerbose("audio") << "audio";
+  EXPECT_EQ("arm\n", gLastMessage);
+
+  // rules apply to call sites already resolved
+  qi::log::setCategoryVerbosity("audio*", qi::log::debug);
+  qiLogVerbose("audio") << "audio";
+  EXPECT_EQ("audio\n", gLastMessage);
+
+  // a single call site logging to several categories
+  qi::log::clearCategoryVerbosity();
+  qi::log::setCategoryVerbosity("foo", qi::log::verbose);
+  logCategory("bar");
+  EXPECT_EQ("audio\n", gLastMessage);
+  logCategory("foo");
+  EXPECT_EQ("foo\n", gLastMessage);
+  logCategory("bar");
+  EXPECT_EQ("foo\n", gLastMessage);
+
+  qi::os::setenv("VERBOSE_CATEGORIES", "net.*=debug,net.tcp=1");
+  qi::log::clearCategoryVerbosity();
+  qi::log::setVerbosity(qi::log::info);
+  qi::os::setenv("VERBOSE_CATEGORIES", "");
+  EXPECT_EQ(qi::log::debug, qi::log::verbosity("net.udp"));
+  EXPECT_EQ(qi::log::fatal, qi::log::verbosity("net.tcp"));
+
+  qi::log::clearCategoryVerbosity();
+  qi::log::init(qi::log::info, 0, true);
+}
+
+static boost::atomic<int> gCounted(0);
+
+static void countHandler(const qi::log::LogRecord * /*records*/, unsigned int count)
+{
+  gCounted.fetch_add(count);
+}
+
+static void nopHandler(const qi::log::LogRecord * /*records*/, unsigned int /*count*/)
+{
+}
+
+static void logMany()
+{
+  for (int i = 0; i < 2000; i++)
+    qiLogInfo("core.log.registry", "%d", i);
+}
+
+TEST(log, loghandlerregistry)
+{
+  qi::log::init(qi::log::info, 0, true);
+  qi::log::removeLogHandler("consoleloghandler");
+  qi::log::addLogBatchHandler("count", countHandler);
+  gCounted.store(0);
+
+  // handlers come and go while 4 threads log synchronously
+  boost::thread_group producers;
+  for (int t = 0; t < 4; ++t)
+    producers.create_thread(&logMany);
+  for (int i = 0; i < 200; ++i)
+  {
+    qi::log::addLogBatchHandler("nop", nopHandler);
+    qi::log::removeLogHandler("nop");
+  }
+  producers.join_all();
+  EXPECT_EQ(4 * 2000, gCounted.load());
+
+  // once removed, a handler is never called again
+  qi::log::removeLogHandler("count");
+  qiLogInfo("core.log.registry", "after");
+  EXPECT_EQ(4 * 2000, gCounted.load());
+
+  qi::log::init(qi::log::info, 0, true);
+}
+
+static std::string gPadded;
+static std::string gFile;
+
+static void paddedHandler(const qi::log::LogRecord *records, unsigned int count)
+{
+  gPadded = records[count - 1].paddedCategory;
+  gFile = records[count - 1].file;
+}
+
+inline void inlineLog(int i)
+{
+  qiLogInfo("core.log.site.inline") << "inline " << i;
+}
+
+TEST(log, logcallsites)
+{
+  qi::log::init(qi::log::info, 0, true);
+  qi::log::removeLogHandler("consoleloghandler");
+  qi::log::addLogBatchHandler("padded", paddedHandler);
+
+  qiLogInfo("core.log.site") << "registered";
+  EXPECT_EQ("core.log.site   ", gPadded);
+  EXPECT_EQ(__FILE__, gFile);
+  qiLogInfo("core.log.site.with.a.long.name") << "cut";
+  EXPECT_EQ("...h.a.long.name", gPadded);
+
+  std::vector<qi::log::LogCallSite> sites = qi::log::callSites();
+  int found = 0;
+  for (unsigned int i = 0; i < sites.size(); ++i)
+  {
+    if (std::string(sites[i].category) != "core.log.site")
+      continue;
+    ++found;
+    EXPECT_EQ(std::string(__FILE__), sites[i].file);
+    EXPECT_GT(sites[i].line, 0);
+  }
+  EXPECT_EQ(1, found);
+
+  // one call site for a statement of an inline function
+  inlineLog(1);
+  inlineLog(2);
+  sites = qi::log::callSites();
+  found = 0;
+  for (unsigned int i = 0; i < sites.size(); ++i)
+    found += std::string(sites[i].category) == "core.log.site.inline";
+  EXPECT_EQ(1, found);
+
+  // a name in a reused buffer is not taken for the first one
+  char name[32];
+  const char *names[3] = { "motion", "audio", "video" };
+  const char *padded[3] = { "motion          ", "", "video           " };
+  qi::log::setCategoryVerbosity("audio", qi::log::silent);
+  for (int i = 0; i < 3; ++i)
+  {
+    strcpy(name, names[i]);
+    gPadded = "";
+    qiLogInfo(name) << "dynamic";
+    EXPECT_EQ(padded[i], gPadded);
+  }
+  // the same through a pointer
+  std::string reused;
+  for (int i = 0; i < 3; ++i)
+  {
+    reused = names[i];
+    gPadded = "";
+    qiLogInfo(reused.c_str()) << "dynamic";
+    EXPECT_EQ(padded[i], gPadded);
+  }
+  qi::log::clearCategoryVerbosity();
+
+  qi::log::removeLogHandler("padded");
+  qi::log::init(qi::log::info, 0, true);
+}
+
+static std::vector<qi::log::LogRecord> gStamped;
+
+static void stampHandler(const qi::log::LogRecord *records, unsigned int count)
+{
+  gStamped.insert(gStamped.end(), records, records + count);
+}
+
+static void checkClock(qi::log::LogClock clock)
+{
+  qi::log::setTimestampClock(clock);
+  gStamped.clear();
+  qi::os::timeval before, after;
+  qi::os::gettimeofday(&before);
+  for (int i = 0; i < 100; i++)
+    qiLogInfo("core.log.clock") << i;
+  qi::os::msleep(20);
+  qiLogInfo("core.log.clock") << "late";
+  qi::os::gettimeofday(&after);
+
+  ASSERT_EQ(101u, gStamped.size());
+  for (unsigned int i = 1; i < gStamped.size(); ++i)
+    EXPECT_LE(gStamped[i - 1].timestamp, gStamped[i].timestamp);
+  EXPECT_GE(gStamped[100].timestamp - gStamped[99].timestamp, 15000000u);
+  // the dates follow the wall clock, give the coarse clock some slack
+  EXPECT_GE(gStamped[0].date.tv_sec, before.tv_sec - 1);
+  EXPECT_LE(gStamped[100].date.tv_sec, after.tv_sec + 1);
+}
+
+static boost::atomic<bool> gStormStop;
+
+static void logClockStorm()
+{
+  for (int i = 0; i < 1000 || !gStormStop.load(); i++)
+    qiLogInfo("core.log.clock") << i;
+}
+
+TEST(log, logtimestamps)
+{
+  qi::log::init(qi::log::info, 0, true);
+  qi::log::removeLogHandler("consoleloghandler");
+  qi::log::addLogBatchHandler("stamp", stampHandler);
+
+  checkClock(qi::log::monotonicClock);
+  checkClock(qi::log::coarseClock);
+  checkClock(qi::log::tscClock);
+
+  // selecting the cycle counter again keeps its calibration, the threads
+  // stamping records meanwhile are not disturbed
+  gStamped.clear();
+  qi::os::timeval before, after;
+  qi::os::gettimeofday(&before);
+  gStormStop.store(false);
+  boost::thread storm(&logClockStorm);
+  for (int i = 0; i < 5; i++)
+    qi::log::setTimestampClock(qi::log::tscClock);
+  gStormStop.store(true);
+  storm.join();
+  qi::os::gettimeofday(&after);
+  ASSERT_FALSE(gStamped.empty());
+  for (unsigned int i = 0; i < gStamped.size(); ++i)
+  {
+    EXPECT_GE(gStamped[i].date.tv_sec, before.tv_sec - 1);
+    EXPECT_LE(gStamped[i].date.tv_sec, after.tv_sec + 1);
+  }
+
+  qi::log::setTimestampClock(qi::log::monotonicClock);
+  EXPECT_EQ(qi::log::monotonicClock, qi::log::timestampClock());
+
+  qi::log::removeLogHandler("stamp");
+  qi::log::init(qi::log::info, 0, true);
+}
+
+static std::vector<std::string> gCollected;
+
+static void collectHandler(const qi::log::LogLevel /*verb*/,
+                           const qi::os::timeval   /*date*/,
+                           const char              * /*category*/,
+                           const char              *msg,
+                           const char              * /*file*/,
+                           const char              * /*fct*/,
+                           const int               /*line*/)
+{
+  gCollected.push_back(msg);
+}
+
+TEST(log, logratelimit)
+{
+  qi::log::init(qi::log::info, 0, true);
+  qi::log::removeLogHandler("consoleloghandler");
+  qi::log::addLogHandler("collect", collectHandler);
+  unsigned long suppressed = qi::log::suppressedLogs();
+
+  // the first occurrence goes through, the repeats are collapsed
+  qi::log::setRepeatSuppression(qi::log::warning, true);
+  for (int i = 0; i < 1002; ++i)
+    qiLogWarning("core.log.storm") << (i < 1000 ? "sensor lost" : "sensor back");
+  qi::log::flush();
+  ASSERT_EQ(4u, gCollected.size());
+  EXPECT_EQ("sensor lost\n", gCollected[0]);
+  EXPECT_EQ("last message repeated 999 times\n", gCollected[1]);
+  EXPECT_EQ("sensor back\n", gCollected[2]);
+  EXPECT_EQ("last message repeated 1 times\n", gCollected[3]);
+  EXPECT_EQ(suppressed + 1000, qi::log::suppressedLogs());
+
+  // other levels are not limited
+  gCollected.clear();
+  for (int i = 0; i < 10; ++i)
+    qiLogInfo("core.log.storm") << "same";
+  EXPECT_EQ(10u, gCollected.size());
+
+  // the burst goes through, then about 10 records per second
+  gCollected.clear();
+  qi::log::setRateLimit(qi::log::info, 10, 5);
+  for (int i = 0; i < 100; ++i)
+    qiLogInfo("core.log.storm", "reading %d", i);
+  EXPECT_GE(gCollected.size(), 5u);
+  EXPECT_LE(gCollected.size(), 7u);
+  EXPECT_EQ("reading 0\n", gCollected[0]);
+  size_t passed = gCollected.size();
+  qi::log::flush();
+  ASSERT_EQ(passed + 1, gCollected.size());
+  EXPECT_NE(std::string::npos, gCollected.back().find("suppressed by the rate limit"));
+
+  // the limit is per call site
+  gCollected.clear();
+  for (int i = 0; i < 3; ++i)
+  {
+    qiLogInfo("core.log.storm") << "first";
+    qiLogInfo("core.log.storm") << "second";
+  }
+  EXPECT_EQ(6u, gCollected.size());
+
+  qi::log::setRateLimit(qi::log::info, 0);
+  qi::log::setRepeatSuppression(qi::log::warning, false);
+  qi::log::removeLogHandler("collect");
+  qi::log::init(qi::log::info, 0, true);
+}
+
+static void nestingHandler(const qi::log::LogLevel /*verb*/,
+                           const qi::os::timeval   /*date*/,
+                           const char              *category,
+                           const char              *msg,
+                           const char              * /*file*/,
+                           const char              * /*fct*/,
+                           const int               /*line*/)
+{
+  if (std::strcmp(category, "core.log.outer") == 0)
+  {
+    qiLogInfo("core.log.inner", "inner %d", 2);
+  }
+  gCollected.push_back(msg);
+}
+
+TEST(log, lognestedsync)
+{
+  qi::log::init(qi::log::info, 0, true);
+  qi::log::removeLogHandler("consoleloghandler");
+  qi::log::addLogHandler("nesting", nestingHandler);
+  gCollected.clear();
+
+  // the handler logs from the delivery, in the same thread
+  qiLogInfo("core.log.outer", "outer %d", 1);
+  ASSERT_EQ(2u, gCollected.size());
+  EXPECT_EQ("inner 2\n", gCollected[0]);
+  EXPECT_EQ("outer 1\n", gCollected[1]);
+
+  qi::log::removeLogHandler("nesting");
+  gCollected.clear();
+}
+
+TEST(log, logformatter)
+{
+  qi::os::timeval date;
+  date.tv_sec = 12;
+  date.tv_usec = 34;
+  char buffer[128];
+
+  qi::log::LogFormatter custom("%t %L %C|%c|%f(%l) %F %m 100%%");
+  unsigned int levelBegin;
+  unsigned int levelEnd;
+  unsigned int size = custom.format(buffer, sizeof(buffer), qi::log::warning, date,
+                                    "core.log.formatter", "message", "file.cpp", "fct", -7,
+                                    &levelBegin, &levelEnd);
+  EXPECT_EQ("12.000034 [WARN ] core.log.formatter|...log.formatter|file.cpp(-7) fct message 100%",
+            std::string(buffer));
+  EXPECT_EQ(strlen(buffer), size);
+  EXPECT_EQ("[WARN ]", std::string(buffer + levelBegin, levelEnd - levelBegin));
+
+  // truncated to the buffer
+  size = custom.format(buffer, 16, qi::log::info, date, "cat", "msg", "f", "fn", 1);
+  EXPECT_EQ(15u, size);
+  EXPECT_EQ("12.000034 [INFO", std::string(buffer));
+
+  // the default one follows the context, then the global pattern
+  qi::log::LogFormatter formatter;
+  qi::log::setContext(1);
+  formatter.format(buffer, sizeof(buffer), qi::log::info, date, "cat", "msg", "f", "fn", 1);
+  EXPECT_EQ("[INFO ] cat             : msg", std::string(buffer));
+  qi::log::setContext(3);
+  formatter.format(buffer, sizeof(buffer), qi::log::info, date, "cat", "msg", "f", "fn", 1);
+  EXPECT_EQ("[INFO ] f(1) msg", std::string(buffer));
+  qi::log::setLogPattern("%m <%C>");
+  formatter.format(buffer, sizeof(buffer), qi::log::info, date, "cat", "msg", "f", "fn", 1);
+  EXPECT_EQ("msg <cat>", std::string(buffer));
+  qi::log::setLogPattern("");
+  qi::log::setContext(0);
+  formatter.format(buffer, sizeof(buffer), qi::log::info, date, "cat", "msg", "f", "fn", 1);
+  EXPECT_EQ("[INFO ] msg", std::string(buffer));
+}
+
+#ifndef _WIN32
+TEST(log, logconsolebatch)
+{
+  std::stringstream ss;
+  ss << qi::os::tmp() << "/test_qilog_console_" << qi::os::getpid() << ".log";
+  std::string path = ss.str();
+
+  qi::log::LogField field;
+  field.key = "joint";
+  field.type = qi::log::intField;
+  field.value.i = 3;
+  qi::log::LogRecord records[3];
+  const char *messages[3] = { "first\n", "second\n", "third\n" };
+  for (int i = 0; i < 3; ++i)
+  {
+    memset(&records[i], 0, sizeof(records[i]));
+    records[i].level = qi::log::info;
+    records[i].category = "core.log.console";
+    records[i].message = messages[i];
+    records[i].file = "file.cpp";
+    records[i].function = "fct";
+  }
+  records[1].fields = &field;
+  records[1].fieldCount = 1;
+
+  // the standard output goes to the file meanwhile
+  fflush(stdout);
+  int out = dup(1);
+  FILE *file = fopen(path.c_str(), "w+");
+  ASSERT_TRUE(file != 0);
+  dup2(fileno(file), 1);
+  {
+    qi::log::setContext(1);
+    qi::log::ConsoleLogHandler console;
+    console.logBatch(records, 3);
+    console.setBatching(false);
+    console.logBatch(records, 1);
+    qi::log::setContext(0);
+  }
+  fflush(stdout);
+  dup2(out, 1);
+  close(out);
+  fclose(file);
+
+  std::ifstream in(path.c_str());
+  std::string content((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+  EXPECT_EQ("[INFO ] core.log.console: first\n"
+            "[INFO ] core.log.console: second joint=3\n"
+            "[INFO ] core.log.console: third\n"
+            "[INFO ] core.log.console: first\n", content);
+  remove(path.c_str());
+}
+
+static std::string fileContent(const std::string &path)
+{
+  std::ifstream in(path.c_str());
+  return std::string((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+}
+
+TEST(log, logfilebuffered)
+{
+  std::stringstream ss;
+  ss << qi::os::tmp() << "/test_qilog_file_" << qi::os::getpid() << ".log";
+  std::string path = ss.str();
+  qi::os::timeval date = { 0, 0 };
+  qi::log::setContext(0);
+
+  {
+    qi::log::FileLogPolicy policy;
+    policy.flushInterval = 0;
+    qi::log::FileLogHandler file(path, policy);
+    file.log(qi::log::info, date, "core.log.file", "first\n", "", "", 0);
+    file.log(qi::log::warning, date, "core.log.file", "second\n", "", "", 0);
+    EXPECT_EQ("", fileContent(path));
+    // an error does not wait, nor what came before it
+    file.log(qi::log::error, date, "core.log.file", "third\n", "", "", 0);
+    EXPECT_EQ("[INFO ] first\n[WARN ] second\n[ERROR] third\n", fileContent(path));
+    file.log(qi::log::info, date, "core.log.file", "fourth\n", "", "", 0);
+    file.flush();
+    EXPECT_EQ("[INFO ] first\n[WARN ] second\n[ERROR] third\n[INFO ] fourth\n",
+              fileContent(path));
+    file.log(qi::log::info, date, "core.log.file", "fifth\n", "", "", 0);
+  }
+  EXPECT_EQ("[INFO ] first\n[WARN ] second\n[ERROR] third\n[INFO ] fourth\n[INFO ] fifth\n",
+            fileContent(path));
+
+  {
+    qi::log::FileLogPolicy policy;
+    policy.flushInterval = 20;
+    policy.syncInterval = 20;
+    qi::log::FileLogHandler file(path, policy);
+    file.log(qi::log::info, date, "core.log.file", "first\n", "", "", 0);
+    for (int i = 0; i < 100 && fileContent(path).empty(); ++i)
+      qi::os::msleep(10);
+    EXPECT_EQ("[INFO ] first\n", fileContent(path));
+  }
+  remove(path.c_str());
+
+  // qi::log::flush() reaches the buffer through the handler flush
+  qi::log::init(qi::log::info, 0, true);
+  qi::log::removeLogHandler("consoleloghandler");
+  {
+    qi::log::FileLogPolicy policy;
+    policy.flushInterval = 0;
+    qi::log::FileLogHandler file(path, policy);
+    qi::log::addLogBatchHandler("file", boost::bind(&qi::log::FileLogHandler::logBatch,
+                                                    &file, _1, _2));
+    qi::log::setLogHandlerFlush("file", boost::bind(&qi::log::FileLogHandler::flush, &file));
+    qiLogInfo("core.log.file", "buffered");
+    EXPECT_EQ("", fileContent(path));
+    qi::log::flush();
+    EXPECT_EQ("[INFO ] buffered\n", fileContent(path));
+    qi::log::removeLogHandler("file");
+  }
+  remove(path.c_str());
+}
+
+TEST(log, logtailfilerotation)
+{
+  std::stringstream ss;
+  ss << qi::os::tmp() << "/test_qilog_tail_" << qi::os::getpid() << ".log";
+  std::string path = ss.str();
+  qi::os::timeval date = { 0, 0 };
+  qi::log::setContext(0);
+
+  {
+    qi::log::TailFileLogHandler file(path, 100, 2);
+    for (int i = 0; i < 40; ++i)
+    {
+      std::stringstream msg;
+      msg << "line " << 100 + i << "\n";
+      file.log(qi::log::info, date, "core.log.tail", msg.str().c_str(), "", "", 0);
+      // the generations are moved meanwhile, a rotation does not wait for them
+      file.flush();
+    }
+  }
+
+  // 6 lines of 17 bytes by file, the newest generation is .1
+  EXPECT_EQ("[INFO ] line 136\n[INFO ] line 137\n[INFO ] line 138\n[INFO ] line 139\n",
+            fileContent(path));
+  std::string first = fileContent(path + ".1");
+  std::string second = fileContent(path + ".2");
+  EXPECT_EQ(0u, first.find("[INFO ] line 130\n"));
+  EXPECT_EQ(6u * 17u, first.size());
+  EXPECT_EQ(0u, second.find("[INFO ] line 124\n"));
+  EXPECT_EQ(6u * 17u, second.size());
+  EXPECT_FALSE(std::ifstream((path + ".0").c_str()).good());
+  EXPECT_FALSE(std::ifstream((path + ".3").c_str()).good());
+  remove(path.c_str());
+  remove((path + ".1").c_str());
+  remove((path + ".2").c_str());
+
+  // the file cannot be renamed: it goes on, and is renamed later
+  ASSERT_EQ(0, mkdir((path + ".0").c_str(), 0700));
+  ASSERT_EQ(0, mkdir((path + ".0/busy").c_str(), 0700));
+  {
+    qi::log::TailFileLogHandler file(path, 100, 2);
+    for (int i = 0; i < 10; ++i)
+      file.log(qi::log::info, date, "core.log.tail", "stuck\n", "", "", 0);
+    EXPECT_EQ(10u * 14u, fileContent(path).size());
+    rmdir((path + ".0/busy").c_str());
+    rmdir((path + ".0").c_str());
+    file.log(qi::log::info, date, "core.log.tail", "moved\n", "", "", 0);
+    file.flush();
+  }
+  EXPECT_EQ("", fileContent(path));
+  EXPECT_EQ(11u * 14u, fileContent(path + ".1").size());
+  remove(path.c_str());
+  remove((path + ".1").c_str());
+}
+
+// Nobody reads the output: the handler must not wait, count what it
+// drops, and say so once the output is drained.
+static void checkNonBlocking(int fds[2])
+{
+  fflush(stdout);
+  int out = dup(1);
+  dup2(fds[1], 1);
+
+  std::string content;
+  unsigned long dropped;
+  unsigned long total = 0;
+  const int count = 10000;
+  {
+    qi::log::setContext(0);
+    qi::log::ConsoleLogHandler console;
+    bool nonBlocking = console.setNonBlocking(true, 0);
+    // the standard output itself is left blocking
+    int flags = fcntl(1, F_GETFL);
+    qi::os::timeval date = { 0, 0 };
+    for (int i = 0; nonBlocking && i < count; ++i)
+      console.log(qi::log::info, date, "core.log.console",
+                  "a line long enough to fill the pipe soon\n", "", "", 0);
+    dropped = console.droppedLines();
+
+    // drain the output, the next line brings the rest and the marker
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    char buffer[4096];
+    for (int i = 0; nonBlocking && i < 100; ++i)
+    {
+      ssize_t n;
+      while ((n = read(fds[0], buffer, sizeof(buffer))) > 0)
+        content.append(buffer, n);
+      console.log(qi::log::info, date, "core.log.console", "last\n", "", "", 0);
+    }
+    ssize_t n;
+    while ((n = read(fds[0], buffer, sizeof(buffer))) > 0)
+      content.append(buffer, n);
+    total = console.droppedLines();
+    dup2(out, 1);
+    close(out);
+    ASSERT_TRUE(nonBlocking);
+    EXPECT_EQ(0, flags & O_NONBLOCK);
+  }
+  close(fds[0]);
+  close(fds[1]);
+
+  EXPECT_GT(dropped, 0u);
+  std::stringstream marker;
+  marker << "qi.log: " << dropped << " lines dropped\n";
+  EXPECT_NE(std::string::npos, content.find(marker.str()));
+  size_t lines = std::count(content.begin(), content.end(), '\n');
+  // each line is delivered whole or dropped, and the marker is one more
+  EXPECT_EQ(count + 100 + 1, lines + total);
+}
+
+TEST(log, logconsolenonblocking)
+{
+  int fds[2];
+  ASSERT_EQ(0, pipe(fds));
+  checkNonBlocking(fds);
+  // a socket is not reopened but written without waiting
+  ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  checkNonBlocking(fds);
+}
+#endif
@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2012 Aldebaran Robotics. All rights reserved.
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the COPYING file.
+ */
+
+/*
+ * Print the records of a crash ring written by qi::log::setCrashRing,
+ * oldest first, with all the context:
+ *
+ * $ qilogdump -n 100 /tmp/qilog-1234.ring
+ */
+
+#include <qi/log.hpp>
+
+#include <cstdio>
+#include <iostream>
+#include <string>
+
+#include <boost/program_options.hpp>
+
+namespace po = boost::program_options;
+
+static void printRecords(const qi::log::LogRecord *records, unsigned int count)
+{
+  char fields[1024];
+  for (unsigned int i = 0; i < count; ++i)
+  {
+    const qi::log::LogRecord &r = records[i];
+    printf("%ld.%06ld %s %s: %s(%d) %s %s",
+           (long)r.date.tv_sec, (long)r.date.tv_usec,
+           qi::log::logLevelToString(r.level), r.category,
+           r.file, r.line, r.function, r.message);
+    // the fields start with a space
+    qi::log::formatFields(r, fields, sizeof(fields));
+    printf("%s\n", fields);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  po::options_description desc("Usage: qilogdump [options] file\nAllowed options");
+  unsigned int last;
+  std::string file;
+
+  desc.add_options()
+    ("help,h", "Produces help message")
+    ("last,n", po::value<unsigned int>(&last)->default_value(0), "Only print the last records. Default: 0 (all)")
+    ("file", po::value<std::string>(&file), "Crash ring file")
+    ;
+  po::positional_options_description positional;
+  positional.add("file", 1);
+
+  po::variables_map vm;
+  try
+  {
+    po::store(po::command_line_parser(argc, argv).options(desc).positional(positional).run(), vm);
+    po::notify(vm);
+  }
+  catch (po::error &e)
+  {
+    std::cerr << e.what() << std::endl;
+    std::cout << desc << std::endl;
+    return 1;
+  }
+
+  if (vm.count("help") || file.empty())
+  {
+    std::cout << desc << std::endl;
+    return vm.count("help") ? 0 : 1;
+  }
+
+  if (!qi::log::readCrashRing(file, printRecords, last))
+  {
+    std::cerr << "qilogdump: " << file << " is not a crash ring" << std::endl;
+    return 1;
+  }
+  return 0;
+}